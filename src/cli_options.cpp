@@ -1,16 +1,33 @@
 #include <spdlog/spdlog.h>
+#include <algorithm>
 #include <map>
 #include <string>
 #include "cli_options.h"
 
+namespace {
+const std::map<string, spdlog::level::level_enum> log_level_map{
+    {"trace", spdlog::level::trace},
+    {"debug", spdlog::level::debug},
+    {"info", spdlog::level::info},
+    {"warn", spdlog::level::warn},
+    {"error", spdlog::level::err},
+    {"off", spdlog::level::off}};
+} // namespace
+
 std::shared_ptr<Options> configure_cli(CLI::App &app) {
   app.require_subcommand();
   auto options = std::make_shared<Options>();
 
   // Sub-commands
   auto train = app.add_subcommand("train", "MTNess model training");
+  auto preprocess = app.add_subcommand("preprocess", "Encode training data into a binary corpus");
+  auto stats = app.add_subcommand("stats", "Write length and vocab statistics of training data as JSON");
   // auto translate = app.add_subcommand("translate", "MTNess translation");
   
+  app.add_option("--log-level",
+                 options->general_options.log_level,
+                 "Least severe messages logged. debug adds the padding of every batch")
+      ->transform(CLI::CheckedTransformer(log_level_map, CLI::ignore_case));
   app.add_option("--emb-dim",
                  options->model_options.emb_dim,
                  "Dimension of embeddings",
@@ -26,6 +43,19 @@ std::shared_ptr<Options> configure_cli(CLI::App &app) {
                  "Maximum size of vocab",
                  true)
       ->check(CLI::PositiveNumber);
+  app.add_option("--spm-sample-size",
+                 options->training_options.spm_sample_size,
+                 "Number of lines sampled from the training data to create SPM models (0 for all)",
+                 true)
+      ->check(CLI::NonNegativeNumber);
+  app.add_option("--spm-threads",
+                 options->training_options.spm_threads,
+                 "Number of threads creating SPM models, split between source and target",
+                 true)
+      ->check(CLI::PositiveNumber);
+  app.add_flag("--joint-vocab",
+               options->training_options.joint_vocab,
+               "Create a single SPM model from both source and target training data");
   app.add_option("--enc-type",
                  options->model_options.enc_type,
                  "Type of encoder")
@@ -61,13 +91,38 @@ std::shared_ptr<Options> configure_cli(CLI::App &app) {
   app.add_flag("--skip",
                options->model_options.skip,
                "Skip (residual) connections in RNN stacks");
+  app.add_flag("--serial-encoder",
+               options->model_options.serial_encoder,
+               "Run the forward and backward encoder stacks one after the other instead of concurrently. "
+               "Concurrent stacks share libtorch's intra-op threads, so with few cores, or when the "
+               "kernels already use all of them, running them one after the other may be faster");
   
-  train->add_option("--training-data",
-                    options->training_options.training_data,
-                    "Paths to training datasets")
-      ->required()
-      ->expected(2)
+  auto training_data = train->add_option("--training-data",
+                                         options->training_options.training_data,
+                                         "Paths to training datasets: source and target files of one or more corpora")
+      ->expected(2, -1)
       ->check(CLI::ExistingFile);
+  train->add_option("--data-weights",
+                    options->training_options.data_weights,
+                    "Sampling weight of each corpus in --training-data (default: equal weights)")
+      ->needs(training_data)
+      ->check(CLI::NonNegativeNumber);
+  auto binary_data = train->add_option("--binary-data",
+                                       options->training_options.binary_data,
+                                       "Path to binary corpus created with `mtness preprocess`, used instead of --training-data")
+      ->excludes(training_data)
+      ->check(CLI::ExistingFile);
+  train->add_option("--stream-data",
+                    options->training_options.stream_data,
+                    "Tab-separated sentence pairs from a named pipe, or - for standard input. "
+                    "Trains until the stream ends, used instead of --training-data")
+      ->excludes(training_data)
+      ->excludes(binary_data);
+  train->add_option("--stream-reservoir",
+                    options->training_options.stream_reservoir,
+                    "Number of sentence pairs held back to shuffle --stream-data",
+                    true)
+      ->check(CLI::NonNegativeNumber);
   train->add_option("--spm-model",
                     options->training_options.spm_models,
                     "Path to SPM models. Created if non-existent")
@@ -76,6 +131,10 @@ std::shared_ptr<Options> configure_cli(CLI::App &app) {
   train->add_option("--model-dir",
                     options->training_options.model_dir,
                     "Path to model directory");
+  train->add_option("--resume",
+                    options->training_options.resume,
+                    "Path to a checkpoint to resume training from, at the saved position in the data")
+      ->check(CLI::ExistingFile);
   train->add_flag("--overwrite-checkpoints",
                   options->training_options.overwrite,
                   "Overwrite checkpoints instead of keeping them all");
@@ -84,22 +143,101 @@ std::shared_ptr<Options> configure_cli(CLI::App &app) {
                   "Reverse source sentences");
   train->add_option("--max-length",
                     options->training_options.max_length,
-                    "Max length of sentences, longer ones are cropped",
+                    "Max length of sentences in tokens, see --max-length-mode (0 for no limit)",
                     true)
-      ->check(CLI::PositiveNumber);
+      ->check(CLI::NonNegativeNumber);
+  train->add_option("--max-length-mode",
+                    options->training_options.max_length_mode,
+                    "Crop sentences over --max-length, or skip the pairs containing them")
+      ->transform(CLI::CheckedTransformer(max_length_mode_map, CLI::ignore_case));
+  train->add_option("--max-length-ratio",
+                    options->training_options.max_length_ratio,
+                    "Skip pairs where one side is more than this many times longer than the other (0 to disable)",
+                    true)
+      ->check(CLI::NonNegativeNumber);
   train->add_option("--batch-size",
                     options->training_options.batch_size,
                     "Training minibatch size",
                     true)
       ->check(CLI::PositiveNumber);
+  train->add_option("--batch-tokens",
+                    options->training_options.batch_tokens,
+                    "Cap minibatches by number of padded tokens instead of sentences (0 to disable)",
+                    true)
+      ->check(CLI::NonNegativeNumber);
+  train->add_option("--batch-tokens-side",
+                    options->training_options.batch_tokens_side,
+                    "Side(s) whose padded tokens count towards --batch-tokens")
+      ->transform(CLI::CheckedTransformer(batch_tokens_side_map, CLI::ignore_case));
   train->add_option("--maxibatch-size",
                     options->training_options.maxibatch_size,
                     "Number of batches to load and sort",
                     true)
       ->check(CLI::PositiveNumber);
+  train->add_option("--maxibatch-mb",
+                    options->training_options.maxibatch_mb,
+                    "Fill maxi-batches up to this many MB of token ids and read buffers instead of "
+                    "--maxibatch-size batches (0 to disable). The budget is per maxi-batch of each data "
+                    "worker, and each worker holds up to --prefetch-maxibatches + 2 maxi-batches at once",
+                    true)
+      ->check(CLI::NonNegativeNumber);
+  train->add_option("--target-padding",
+                    options->training_options.target_padding,
+                    "Adapt the number of sentence pairs per maxi-batch so that about this percentage "
+                    "of batch positions are padding (0 to disable). Without --maxibatch-mb, maxi-batches "
+                    "grow to at most 16 times --maxibatch-size batches",
+                    true)
+      ->check(CLI::Range(0.0, 100.0));
+  train->add_option("--prefetch-maxibatches",
+                    options->training_options.prefetch_maxibatches,
+                    "Number of maxi-batches filled ahead by a background thread (0 to fill on demand)",
+                    true)
+      ->check(CLI::NonNegativeNumber);
+  train->add_option("--encode-threads",
+                    options->training_options.encode_threads,
+                    "Number of threads encoding training data with SentencePiece, per data worker",
+                    true)
+      ->check(CLI::PositiveNumber);
+  train->add_option("--piece-cache-size",
+                    options->training_options.piece_cache_size,
+                    "Number of words whose SentencePiece segmentation is cached, per SPM model (0 to disable)",
+                    true)
+      ->check(CLI::NonNegativeNumber);
+  train->add_option("--data-workers",
+                    options->training_options.data_workers,
+                    "Number of shards of the training data, each read by its own thread",
+                    true)
+      ->check(CLI::PositiveNumber);
+  train->add_option("--collate-threads",
+                    options->training_options.collate_threads,
+                    "Number of threads cutting and stacking minibatches (0 for one per data worker)",
+                    true)
+      ->check(CLI::NonNegativeNumber);
+  train->add_option("--prefetch-batches",
+                    options->training_options.prefetch_batches,
+                    "Number of collated minibatches queued per collate thread",
+                    true)
+      ->check(CLI::PositiveNumber);
+  train->add_option("--cache-corpus-mb",
+                    options->training_options.cache_corpus_mb,
+                    "Keep the encoded training data in memory after the first epoch, up to this many MB in total (0 to disable)",
+                    true)
+      ->check(CLI::NonNegativeNumber);
+  train->add_flag("--shuffle,!--no-shuffle",
+                  options->training_options.shuffle,
+                  "Shuffle training data every epoch (default)");
+  train->add_option("--shuffle-block",
+                    options->training_options.shuffle_block,
+                    "Number of consecutive sentence pairs kept together when shuffling",
+                    true)
+      ->check(CLI::PositiveNumber);
+  train->add_option("--seed",
+                    options->training_options.seed,
+                    "Seed for shuffling training data",
+                    true);
   train->add_option("--maxi-batch-sort",
                     options->training_options.maxi_sort,
-                    "Sort maxi-batches by length")
+                    "Sort maxi-batches by source or target length, or group pairs into (source, target) length buckets")
       ->transform(CLI::CheckedTransformer(maxi_sort_map, CLI::ignore_case));
   train->add_option("--learning-rate,--lr",
                     options->training_options.learning_rate,
@@ -124,7 +262,77 @@ std::shared_ptr<Options> configure_cli(CLI::App &app) {
                     true)
       ->check(CLI::PositiveNumber);
 
+  preprocess->add_option("--training-data",
+                         options->training_options.training_data,
+                         "Paths to training datasets")
+      ->required()
+      ->expected(2)
+      ->check(CLI::ExistingFile);
+  preprocess->add_option("--spm-model",
+                         options->training_options.spm_models,
+                         "Path to SPM models. Created if non-existent")
+      ->required()
+      ->expected(2);
+  preprocess->add_flag("--reverse-src",
+                       options->training_options.reverse_src,
+                       "Reverse source sentences");
+  preprocess->add_option("--piece-cache-size",
+                         options->training_options.piece_cache_size,
+                         "Number of words whose SentencePiece segmentation is cached, per SPM model (0 to disable)",
+                         true)
+      ->check(CLI::NonNegativeNumber);
+  preprocess->add_option("--output,-o",
+                         options->preprocess_options.output,
+                         "Path to output binary corpus")
+      ->required();
+
+  stats->add_option("--training-data",
+                    options->training_options.training_data,
+                    "Paths to plain text source and target files")
+      ->required()
+      ->expected(2)
+      ->check(CLI::ExistingFile);
+  stats->add_option("--spm-model",
+                    options->training_options.spm_models,
+                    "Path to existing SPM models")
+      ->required()
+      ->expected(2);
+  stats->add_option("--threads",
+                    options->stats_options.threads,
+                    "Number of threads scanning the files (0 for one per core)",
+                    true)
+      ->check(CLI::NonNegativeNumber);
+  stats->add_option("--piece-cache-size",
+                    options->training_options.piece_cache_size,
+                    "Number of words whose SentencePiece segmentation is cached, per SPM model (0 to disable)",
+                    true)
+      ->check(CLI::NonNegativeNumber);
+  stats->add_option("--output,-o",
+                    options->stats_options.output,
+                    "Path to output JSON file, - for standard output",
+                    true);
+
+  train->callback([options]() {
+    if(options->training_options.training_data.empty() && options->training_options.binary_data.empty()
+       && options->training_options.stream_data.empty()) {
+      throw CLI::RequiredError("--training-data, --binary-data or --stream-data");
+    }
+    const auto &training_data = options->training_options.training_data;
+    if(training_data.size() % 2 != 0) {
+      throw CLI::ValidationError("--training-data", "Expected source and target files for each corpus");
+    }
+    const auto &data_weights = options->training_options.data_weights;
+    if(!data_weights.empty() && data_weights.size() != training_data.size() / 2) {
+      throw CLI::ValidationError("--data-weights", "Expected one weight per corpus in --training-data");
+    }
+    if(!data_weights.empty() && std::none_of(data_weights.begin(), data_weights.end(),
+                                             [](double weight) { return weight > 0; })) {
+      throw CLI::ValidationError("--data-weights", "At least one corpus needs a positive weight");
+    }
+  });
+
   app.callback([options]() {
+    spdlog::set_level(options->general_options.log_level);
     if(!torch::cuda::is_available() || options->training_options.cpu) {
       spdlog::warn("GPU disabled or not found. Using CPU only");
       options->training_options.cpu = true;
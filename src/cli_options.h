@@ -2,6 +2,7 @@
 
 #include <torch/torch.h>
 #include <CLI11/CLI11.hpp>
+#include <spdlog/spdlog.h>
 #include <memory>
 #include <string>
 #include <vector>
@@ -10,7 +11,9 @@
 using std::string;
 using std::vector;
 
-struct GeneralOptions {};
+struct GeneralOptions {
+  spdlog::level::level_enum log_level = spdlog::level::info;
+};
 
 struct ModelOptions {
   EncoderType enc_type = EncoderType::bidirectional;
@@ -26,19 +29,44 @@ struct ModelOptions {
   size_t trg_vocab_size;
   bool tied_embeddings = false;
   bool skip = false;
+  bool serial_encoder = false;
 };
 
 struct TrainingOptions {
   vector<string> training_data;
+  vector<double> data_weights;
+  string binary_data;
+  string stream_data;
+  size_t stream_reservoir = 100000;
   vector<string> spm_models;
+  size_t spm_sample_size = 10000000;
+  size_t spm_threads = 16;
+  bool joint_vocab = false;
   string model_dir = "model";
+  string resume;
   bool overwrite = false;
   bool reverse_src = false;
   size_t batch_size = 32;
+  size_t batch_tokens = 0;
+  BatchTokensSide batch_tokens_side = BatchTokensSide::both;
   size_t maxibatch_size = 100;
+  size_t maxibatch_mb = 0;
+  double target_padding = 0;
+  size_t prefetch_maxibatches = 1;
+  size_t encode_threads = 4;
+  size_t piece_cache_size = 200000;
+  size_t data_workers = 1;
+  size_t collate_threads = 0;
+  size_t prefetch_batches = 2;
+  size_t cache_corpus_mb = 0;
+  bool shuffle = true;
+  size_t shuffle_block = 10000;
+  size_t seed = 1234;
   MaxiBatchSortKey maxi_sort = MaxiBatchSortKey::target;
   size_t epochs = 1;
   size_t max_length = 100;
+  MaxLengthMode max_length_mode = MaxLengthMode::crop;
+  double max_length_ratio = 0;
   bool cpu = false;
   torch::DeviceType device = torch::kCUDA;
   double learning_rate = 1e-3;
@@ -46,6 +74,15 @@ struct TrainingOptions {
   size_t save_freq = 100;
 };
 
+struct PreprocessOptions {
+  string output;
+};
+
+struct StatsOptions {
+  string output = "-";
+  size_t threads = 0;
+};
+
 struct ValidationOptions {};
 
 struct TranslationOptions {};
@@ -54,6 +91,8 @@ struct Options {
   GeneralOptions general_options;
   ModelOptions model_options;
   TrainingOptions training_options;
+  PreprocessOptions preprocess_options;
+  StatsOptions stats_options;
   ValidationOptions validation_options;
   TranslationOptions translation_options;
 };
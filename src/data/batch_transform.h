@@ -2,6 +2,8 @@
 
 #include <torch/torch.h>
 #include <vector>
+#include "types.h"
+#include "tensor_utils.h"
 
 using namespace torch::data;
 using torch::indexing::Slice;
@@ -18,6 +20,18 @@ class PadAndStack<Example<MaskedData, MaskedData>>
     : public transforms::Collation<Example<MaskedData, MaskedData>> {
  public:
   PadAndStack() {}
+
+  // Collates token ids straight into a single {seq_len, batch_size} buffer per side,
+  // without creating tensors for the individual examples.
+  // Masks are derived from the lengths in one op, so the number of
+  // allocations does not depend on the batch size.
+  // pairs provides size(), length(i, side) and copy_ids(i, side, out, stride),
+  // with side 0 for the source and 1 for the target (e.g. MaxiBatchSelection)
+  template <typename Pairs>
+  static Example<MaskedData, MaskedData> collate(const Pairs &pairs) {
+    return {stack(pairs, 0), stack(pairs, 1)};
+  }
+
   Example<MaskedData, MaskedData> apply_batch(vector<Example<MaskedData, MaskedData>> examples) override {
     vector<Tensor> data, targets, data_mask, targets_mask;
     vector<int64_t> data_lengths, target_lengths;
@@ -52,6 +66,35 @@ class PadAndStack<Example<MaskedData, MaskedData>>
                        padded_targets_mask,
                        torch::tensor(target_lengths))};
   }
+
+ private:
+  // Pads with 0 and stacks one side of the pairs into {seq_len, batch_size}
+  template <typename Pairs>
+  static MaskedData stack(const Pairs &pairs, int side) {
+    const int64_t batch_size = pairs.size();
+    size_t seq_len = 0;
+    for(int64_t b = 0; b < batch_size; ++b) {
+      seq_len = std::max(seq_len, pairs.length(b, side));
+    }
+
+    Tensor data = torch::zeros({static_cast<int64_t>(seq_len), batch_size}, torch::kLong);
+    Tensor lengths = torch::empty({batch_size}, torch::kLong);
+    int64_t *data_ptr = data.data_ptr<int64_t>();
+    int64_t *lengths_ptr = lengths.data_ptr<int64_t>();
+    for(int64_t b = 0; b < batch_size; ++b) {
+      lengths_ptr[b] = pairs.length(b, side);
+      pairs.copy_ids(b, side, data_ptr + b, batch_size);
+    }
+
+    // mask[t][b] = t < lengths[b]
+    Tensor mask = torch::arange(static_cast<int64_t>(seq_len), torch::kLong).unsqueeze(1) < lengths.unsqueeze(0);
+    MaskedData stacked(data, mask, lengths);
+    if(side == 0) {
+      // Built here on the collate thread, and shared by all backward encoder layers
+      stacked.reverse_index = reverse_padded_index(lengths, seq_len);
+    }
+    return stacked;
+  }
 };
 
 template <>
@@ -0,0 +1,169 @@
+#include <spdlog/spdlog.h>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include "binary_corpus.h"
+
+namespace {
+const char kBinaryCorpusMagic[8] = {'M', 'T', 'N', 'E', 'S', 'S', 'B', 'C'};
+const uint64_t kBinaryCorpusVersion = 2;
+
+// Byte position of the offsets table, which is aligned to 8 bytes
+size_t offsets_position(uint64_t num_tokens) {
+  size_t position = sizeof(BinaryCorpusHeader) + num_tokens * sizeof(int32_t);
+  return (position + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
+
+[[noreturn]] void corpus_error(const string &message) {
+  spdlog::error(message);
+  throw std::runtime_error(message);
+}
+} // namespace
+
+BinaryCorpus::BinaryCorpus(const string &path, const CorpusOptions &options) {
+  if(!mapping_.map(path)) {
+    corpus_error(fmt::format("Could not map binary corpus {}: {}", path, std::strerror(errno)));
+  }
+  if(mapping_.size() < sizeof(BinaryCorpusHeader)) {
+    corpus_error(fmt::format("{} is too small to be a binary corpus", path));
+  }
+
+  const auto *header = reinterpret_cast<const BinaryCorpusHeader*>(mapping_.data());
+  if(std::memcmp(header->magic, kBinaryCorpusMagic, sizeof(kBinaryCorpusMagic)) != 0
+     || header->version != kBinaryCorpusVersion) {
+    corpus_error(fmt::format("{} is not a binary corpus of version {}. Rerun `mtness preprocess`",
+                             path, kBinaryCorpusVersion));
+  }
+  num_pairs_ = header->num_pairs;
+  reversed_src_ = header->reversed_src != 0;
+  size_t expected_size = offsets_position(header->num_tokens) + (2 * num_pairs_ + 1) * sizeof(uint64_t);
+  if(mapping_.size() != expected_size) {
+    corpus_error(fmt::format("Binary corpus {} is truncated or corrupt", path));
+  }
+  const char *base = mapping_.data();
+  tokens_ = reinterpret_cast<const int32_t*>(base + sizeof(BinaryCorpusHeader));
+  offsets_ = reinterpret_cast<const uint64_t*>(base + offsets_position(header->num_tokens));
+  begin_ = num_pairs_ * options.shard / options.num_shards;
+  end_ = num_pairs_ * (options.shard + 1) / options.num_shards;
+  blocks_ = std::make_unique<BlockShuffler>(begin_, end_, options);
+  if(options.shuffle_block == 0) {
+    // Pairs are mostly read front to back
+    mapping_.advise_sequential();
+  }
+  spdlog::info("Mapped binary corpus {} with {} sentence pairs ({} in shard {})",
+               path, num_pairs_, end_ - begin_, options.shard);
+}
+
+// Points pair_offsets to the offsets of the next pair
+bool BinaryCorpus::next_pair(const uint64_t *&pair_offsets) {
+  if(position_ >= block_end_ && !blocks_->next_block(position_, block_end_)) {
+    return false;
+  }
+  pair_offsets = offsets_ + 2 * position_;
+  ++position_;
+  return true;
+}
+
+bool BinaryCorpus::next(vector<int> &src_ids, vector<int> &trg_ids) {
+  const uint64_t *pair_offsets;
+  if(!next_pair(pair_offsets)) {
+    return false;
+  }
+  src_ids.assign(tokens_ + pair_offsets[0], tokens_ + pair_offsets[1]);
+  trg_ids.assign(tokens_ + pair_offsets[1], tokens_ + pair_offsets[2]);
+  return true;
+}
+
+size_t BinaryCorpus::read_views(size_t max_pairs, vector<IdSpan> &src_ids, vector<IdSpan> &trg_ids) {
+  src_ids.clear();
+  trg_ids.clear();
+  const uint64_t *pair_offsets;
+  while(src_ids.size() < max_pairs && next_pair(pair_offsets)) {
+    src_ids.emplace_back(tokens_ + pair_offsets[0], pair_offsets[1] - pair_offsets[0]);
+    trg_ids.emplace_back(tokens_ + pair_offsets[1], pair_offsets[2] - pair_offsets[1]);
+  }
+  return src_ids.size();
+}
+
+void BinaryCorpus::reset() {
+  blocks_->reset();
+  position_ = block_end_ = 0;
+}
+
+// Epoch, blocks started, next pair, end of the current block
+vector<int64_t> BinaryCorpus::state() const {
+  return {static_cast<int64_t>(blocks_->epoch()),
+          static_cast<int64_t>(blocks_->blocks_started()),
+          static_cast<int64_t>(position_),
+          static_cast<int64_t>(block_end_)};
+}
+
+void BinaryCorpus::restore(const vector<int64_t> &state) {
+  if(state.size() != 4) {
+    return;
+  }
+  size_t first, last;
+  blocks_->restore(state[0], state[1], first, last);
+  position_ = state[2];
+  block_end_ = state[3];
+}
+
+void write_binary_corpus(const string &src_path,
+                         const string &trg_path,
+                         const PieceEncoder &src_encoder,
+                         const PieceEncoder &trg_encoder,
+                         bool reversed_src,
+                         const string &output_path) {
+  LineReader src_file(src_path), trg_file(trg_path);
+  std::ofstream out_file(output_path, std::ios::binary);
+  // Offsets are collected in a temporary file so that memory use doesn't grow with the corpus
+  string offsets_path = output_path + ".offsets.tmp";
+  std::ofstream offsets_file(offsets_path, std::ios::binary);
+  if(!out_file || !offsets_file) {
+    corpus_error(fmt::format("Could not open files to write binary corpus {}", output_path));
+  }
+
+  // Placeholder, rewritten once the counts are known
+  BinaryCorpusHeader header{};
+  std::memcpy(header.magic, kBinaryCorpusMagic, sizeof(kBinaryCorpusMagic));
+  header.version = kBinaryCorpusVersion;
+  header.reversed_src = reversed_src;
+  out_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  string src_line, trg_line;
+  vector<int> src_ids, trg_ids;
+  uint64_t num_tokens = 0;
+  while(src_file.getline(src_line) && trg_file.getline(trg_line)) {
+    src_encoder.encode(src_line, src_ids);
+    trg_encoder.encode(trg_line, trg_ids);
+    for(const auto &ids : {&src_ids, &trg_ids}) {
+      offsets_file.write(reinterpret_cast<const char*>(&num_tokens), sizeof(num_tokens));
+      out_file.write(reinterpret_cast<const char*>(ids->data()), ids->size() * sizeof(int32_t));
+      num_tokens += ids->size();
+    }
+    if(++header.num_pairs % 1000000 == 0) {
+      spdlog::info("Encoded {} sentence pairs", header.num_pairs);
+    }
+  }
+  offsets_file.write(reinterpret_cast<const char*>(&num_tokens), sizeof(num_tokens));
+  offsets_file.close();
+  header.num_tokens = num_tokens;
+
+  // Pad up to the offsets table, then append it
+  size_t padding = offsets_position(num_tokens) - sizeof(header) - num_tokens * sizeof(int32_t);
+  const char zeros[sizeof(uint64_t)] = {};
+  out_file.write(zeros, padding);
+  std::ifstream offsets_in(offsets_path, std::ios::binary);
+  out_file << offsets_in.rdbuf();
+  offsets_in.close();
+  std::filesystem::remove(offsets_path);
+
+  out_file.seekp(0, std::ios::beg);
+  out_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  if(!out_file) {
+    corpus_error(fmt::format("Error writing binary corpus {}", output_path));
+  }
+  spdlog::info("Wrote {} sentence pairs ({} tokens) to {}", header.num_pairs, num_tokens, output_path);
+}
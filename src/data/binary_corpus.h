@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "corpus.h"
+#include "mapped_file.h"
+
+using std::string;
+using std::vector;
+
+// Pre-encoded parallel corpus written by `mtness preprocess`
+//
+// Layout:
+//   BinaryCorpusHeader
+//   int32_t tokens[num_tokens]       Source and target ids of each pair, back to back
+//   (padding to 8 bytes)
+//   uint64_t offsets[2*num_pairs+1]  Token offsets. Pair i source is [offsets[2i], offsets[2i+1]),
+//                                    target is [offsets[2i+1], offsets[2i+2])
+struct BinaryCorpusHeader {
+  char magic[8];
+  uint64_t version;
+  uint64_t num_pairs;
+  uint64_t num_tokens;
+  uint64_t reversed_src;  // Source ids were encoded with reverse:eos
+};
+
+// Read-only memory-mapped view of a binary corpus.
+// The file is mapped shared, so several processes training on the same
+// file share a single copy in the page cache. read_views() hands out the ids
+// in the mapping itself, which MaxiBatch::fill copies once into its arena
+class BinaryCorpus : public Corpus {
+ public:
+  explicit BinaryCorpus(const string &path, const CorpusOptions &options={});
+
+  bool next(vector<int> &src_ids, vector<int> &trg_ids) override;
+  bool has_views() const override { return true; }
+  size_t read_views(size_t max_pairs, vector<IdSpan> &src_ids, vector<IdSpan> &trg_ids) override;
+  void reset() override;
+  std::optional<size_t> size() const override { return end_ - begin_; }
+  // Whether the corpus was written with --reverse-src
+  bool reversed_src() const { return reversed_src_; }
+  vector<int64_t> state() const override;
+  void restore(const vector<int64_t> &state) override;
+
+ private:
+  MappedFile mapping_;
+  size_t num_pairs_ = 0;
+  bool reversed_src_ = false;
+  const int32_t *tokens_ = nullptr;
+  const uint64_t *offsets_ = nullptr;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  std::unique_ptr<BlockShuffler> blocks_;
+  size_t position_ = 0;
+  size_t block_end_ = 0;
+
+  bool next_pair(const uint64_t *&pair_offsets);
+};
+
+// Encodes parallel text files, which may be compressed, with the given
+// encoders and writes them to output_path in the BinaryCorpus format.
+// reversed_src records that src_encoder reverses sentences
+void write_binary_corpus(const string &src_path,
+                         const string &trg_path,
+                         const PieceEncoder &src_encoder,
+                         const PieceEncoder &trg_encoder,
+                         bool reversed_src,
+                         const string &output_path);
@@ -0,0 +1,201 @@
+#include <spdlog/spdlog.h>
+#include "cached_corpus.h"
+
+namespace {
+void put_varint(vector<uint8_t> &bytes, uint32_t value) {
+  while(value >= 0x80) {
+    bytes.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  bytes.push_back(static_cast<uint8_t>(value));
+}
+
+uint32_t get_varint(const uint8_t *&bytes) {
+  uint32_t value = 0;
+  for(int shift = 0; ; shift += 7) {
+    uint8_t byte = *bytes++;
+    value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if(!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+void get_ids(const uint8_t *&bytes, vector<int> &ids) {
+  ids.resize(get_varint(bytes));
+  for(auto &id : ids) {
+    id = static_cast<int>(get_varint(bytes));
+  }
+}
+} // namespace
+
+CachedCorpus::CachedCorpus(std::unique_ptr<Corpus> corpus, size_t max_bytes, const CorpusOptions &options)
+    : corpus_(std::move(corpus)),
+      max_bytes_(max_bytes),
+      options_(options),
+      shard_(options.shard),
+      fill_start_state_(corpus_->state()) {
+  offsets_.push_back(0);
+}
+
+bool CachedCorpus::next(vector<int> &src_ids, vector<int> &trg_ids) {
+  if(!complete_) {
+    if(!corpus_->next(src_ids, trg_ids)) {
+      finish_filling();
+      return false;
+    }
+    store(src_ids, trg_ids);
+    return true;
+  }
+  if(position_ >= block_end_ && !pairs_->next_block(position_, block_end_)) {
+    return false;
+  }
+  load(position_++, src_ids, trg_ids);
+  return true;
+}
+
+// Keeps the bulk reading of the wrapped corpus while filling
+size_t CachedCorpus::read(size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) {
+  if(complete_) {
+    return Corpus::read(max_pairs, src_ids, trg_ids);
+  }
+  size_t num_pairs = corpus_->read(max_pairs, src_ids, trg_ids);
+  for(size_t i = 0; i < num_pairs; ++i) {
+    store(src_ids[i], trg_ids[i]);
+  }
+  if(num_pairs < max_pairs) {
+    finish_filling();
+  }
+  return num_pairs;
+}
+
+void CachedCorpus::store(const vector<int> &src_ids, const vector<int> &trg_ids) {
+  if(!filling_) {
+    return;
+  }
+  for(const auto &ids : {&src_ids, &trg_ids}) {
+    put_varint(bytes_, ids->size());
+    for(int id : *ids) {
+      put_varint(bytes_, static_cast<uint32_t>(id));
+    }
+  }
+  offsets_.push_back(bytes_.size());
+  if(bytes_.size() + offsets_.size() * sizeof(uint64_t) > max_bytes_) {
+    spdlog::warn("Training data of shard {} does not fit in the corpus cache of {} MB. Reading it every epoch",
+                 shard_, max_bytes_ >> 20);
+    clear();
+    disabled_ = true;
+  }
+}
+
+void CachedCorpus::load(size_t pair, vector<int> &src_ids, vector<int> &trg_ids) const {
+  const uint8_t *bytes = bytes_.data() + offsets_[pair];
+  get_ids(bytes, src_ids);
+  get_ids(bytes, trg_ids);
+}
+
+void CachedCorpus::clear() {
+  filling_ = false;
+  bytes_.clear();
+  bytes_.shrink_to_fit();
+  offsets_.assign(1, 0);
+  offsets_.shrink_to_fit();
+}
+
+// Called when the wrapped corpus is exhausted. The store is complete only if
+// it was filling since the beginning of the epoch
+void CachedCorpus::finish_filling() {
+  if(!filling_ || complete_) {
+    return;
+  }
+  filling_ = false;
+  complete_ = true;
+  bytes_.shrink_to_fit();
+  offsets_.shrink_to_fit();
+  size_t num_pairs = offsets_.size() - 1;
+  // Pairs are in memory, so they can be shuffled one by one
+  CorpusOptions shuffle_options = options_;
+  shuffle_options.shuffle_block = options_.shuffle_block > 0 ? 1 : 0;
+  pairs_ = std::make_unique<BlockShuffler>(0, num_pairs, shuffle_options);
+  position_ = block_end_ = 0;
+  spdlog::info("Cached {} sentence pairs of shard {} in {:.1f} MB",
+               num_pairs, shard_, (bytes_.size() + offsets_.size() * sizeof(uint64_t)) / 1048576.0);
+}
+
+void CachedCorpus::reset() {
+  if(complete_) {
+    pairs_->reset();
+    position_ = block_end_ = 0;
+    return;
+  }
+  corpus_->reset();
+  if(!disabled_) {
+    // The previous epoch was not stored from its start, e.g. after resuming. Try again
+    clear();
+    filling_ = true;
+    fill_start_state_ = corpus_->state();
+  }
+}
+
+// Reading from the wrapped corpus: 0, then its state.
+// Reading from memory: 1, epoch, blocks started, next pair, end of the current block,
+// then the state of the wrapped corpus when the store started filling
+vector<int64_t> CachedCorpus::state() const {
+  if(!complete_) {
+    vector<int64_t> state = corpus_->state();
+    state.insert(state.begin(), 0);
+    return state;
+  }
+  vector<int64_t> state = {1,
+                           static_cast<int64_t>(pairs_->epoch()),
+                           static_cast<int64_t>(pairs_->blocks_started()),
+                           static_cast<int64_t>(position_),
+                           static_cast<int64_t>(block_end_)};
+  state.insert(state.end(), fill_start_state_.begin(), fill_start_state_.end());
+  return state;
+}
+
+void CachedCorpus::restore(const vector<int64_t> &state) {
+  if(state.empty()) {
+    return;
+  }
+  if(state[0] == 0) {
+    // Part of this epoch has already been read, so it cannot be stored completely
+    clear();
+    complete_ = false;
+    corpus_->restore(vector<int64_t>(state.begin() + 1, state.end()));
+    return;
+  }
+  if(state.size() < 5) {
+    return;
+  }
+  if(!complete_) {
+    // Rebuild the store in the same order as before
+    fill_start_state_.assign(state.begin() + 5, state.end());
+    fill_all();
+  }
+  if(!complete_) {
+    // Doesn't fit any more, start the epoch over from the wrapped corpus
+    corpus_->restore(fill_start_state_);
+    return;
+  }
+  size_t first, last;
+  pairs_->restore(state[1], state[2], first, last);
+  position_ = state[3];
+  block_end_ = state[4];
+}
+
+// Reads the epoch starting at fill_start_state_ into the store
+void CachedCorpus::fill_all() {
+  clear();
+  corpus_->restore(fill_start_state_);
+  filling_ = !disabled_;
+  vector<int> src_ids, trg_ids;
+  while(corpus_->next(src_ids, trg_ids)) {
+    store(src_ids, trg_ids);
+    if(disabled_) {
+      return;
+    }
+  }
+  finish_filling();
+}
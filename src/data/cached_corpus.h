@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "corpus.h"
+
+using std::vector;
+
+// Keeps the pairs read from another corpus in memory during the first complete
+// epoch, and serves all later epochs from memory without touching the wrapped
+// corpus again. Pairs are reshuffled individually every epoch when shuffling.
+//
+// Token ids are stored as LEB128 varints, so most ids take one or two bytes:
+//   varint src_len, src ids..., varint trg_len, trg ids...
+// If the store grows beyond max_bytes, caching is abandoned and the wrapped
+// corpus is read every epoch as usual
+class CachedCorpus : public Corpus {
+ public:
+  CachedCorpus(std::unique_ptr<Corpus> corpus, size_t max_bytes, const CorpusOptions &options={});
+
+  bool next(vector<int> &src_ids, vector<int> &trg_ids) override;
+  size_t read(size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) override;
+  void reset() override;
+  std::optional<size_t> size() const override { return corpus_->size(); }
+  vector<int64_t> state() const override;
+  void restore(const vector<int64_t> &state) override;
+
+ private:
+  std::unique_ptr<Corpus> corpus_;
+  const size_t max_bytes_;
+  const CorpusOptions options_;
+  const size_t shard_;
+
+  vector<uint8_t> bytes_;
+  vector<uint64_t> offsets_;  // Start of each pair in bytes_
+  // Position of corpus_ when the store started filling, to refill it identically on resume
+  vector<int64_t> fill_start_state_;
+  bool filling_ = true;       // Appending pairs read from corpus_ during this epoch
+  bool complete_ = false;     // Holds a whole epoch, reading from memory
+  bool disabled_ = false;     // Went over max_bytes_
+
+  // Order of the stored pairs in the current epoch
+  std::unique_ptr<BlockShuffler> pairs_;
+  size_t position_ = 0;
+  size_t block_end_ = 0;
+
+  void store(const vector<int> &src_ids, const vector<int> &trg_ids);
+  void load(size_t pair, vector<int> &src_ids, vector<int> &trg_ids) const;
+  void clear();
+  void finish_filling();
+  void fill_all();
+};
@@ -0,0 +1,347 @@
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include "corpus.h"
+
+BlockShuffler::BlockShuffler(size_t begin, size_t end, const CorpusOptions &options)
+    : begin_(begin),
+      end_(end),
+      block_size_(options.shuffle_block > 0 ? options.shuffle_block : std::max<size_t>(end - begin, 1)),
+      shuffle_(options.shuffle_block > 0),
+      // Different shards shuffle differently
+      seed_(options.seed + options.shard) {
+  start_epoch();
+}
+
+bool BlockShuffler::next_block(size_t &first, size_t &last) {
+  if(next_ >= order_.size()) {
+    return false;
+  }
+  first = begin_ + order_[next_++] * block_size_;
+  last = std::min(first + block_size_, end_);
+  return true;
+}
+
+void BlockShuffler::reset() {
+  ++epoch_;
+  start_epoch();
+}
+
+bool BlockShuffler::restore(size_t epoch, size_t blocks_started, size_t &first, size_t &last) {
+  epoch_ = epoch;
+  start_epoch();
+  next_ = std::min(blocks_started, order_.size());
+  if(next_ == 0) {
+    return false;
+  }
+  first = begin_ + order_[next_ - 1] * block_size_;
+  last = std::min(first + block_size_, end_);
+  return true;
+}
+
+void BlockShuffler::start_epoch() {
+  order_.resize((end_ - begin_ + block_size_ - 1) / block_size_);
+  std::iota(order_.begin(), order_.end(), 0);
+  if(shuffle_) {
+    std::seed_seq seed{seed_, static_cast<uint64_t>(epoch_)};
+    std::shuffle(order_.begin(), order_.end(), std::mt19937_64(seed));
+  }
+  next_ = 0;
+}
+
+size_t Corpus::read(size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) {
+  if(src_ids.size() < max_pairs) {
+    src_ids.resize(max_pairs);
+    trg_ids.resize(max_pairs);
+  }
+  size_t num_pairs = 0;
+  while(num_pairs < max_pairs && next(src_ids[num_pairs], trg_ids[num_pairs])) {
+    ++num_pairs;
+  }
+  return num_pairs;
+}
+
+LineCorpus::LineCorpus(std::shared_ptr<const PieceEncoder> src_encoder,
+                       std::shared_ptr<const PieceEncoder> trg_encoder,
+                       const CorpusOptions &options)
+    : src_encoder_(std::move(src_encoder)),
+      trg_encoder_(std::move(trg_encoder)),
+      // A single thread encodes inline on the caller
+      encode_pool_(std::make_unique<ThreadPool>(options.encode_threads > 1 ? options.encode_threads : 0)) {}
+
+bool LineCorpus::next(vector<int> &src_ids, vector<int> &trg_ids) {
+  if(!read_lines(src_line_, trg_line_)) {
+    return false;
+  }
+  src_encoder_->encode(src_line_, src_ids);
+  trg_encoder_->encode(trg_line_, trg_ids);
+  return true;
+}
+
+// Reads the raw lines first, then encodes them in parallel.
+// PieceEncoder::encode is const, so the encoders are shared by all threads
+size_t LineCorpus::read(size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) {
+  if(src_lines_.size() < max_pairs) {
+    src_lines_.resize(max_pairs);
+    trg_lines_.resize(max_pairs);
+  }
+  if(src_ids.size() < max_pairs) {
+    src_ids.resize(max_pairs);
+    trg_ids.resize(max_pairs);
+  }
+  size_t num_pairs = 0;
+  while(num_pairs < max_pairs && read_lines(src_lines_[num_pairs], trg_lines_[num_pairs])) {
+    ++num_pairs;
+  }
+  encode_pool_->parallel_for(num_pairs, [&](size_t i) {
+    src_encoder_->encode(src_lines_[i], src_ids[i]);
+    trg_encoder_->encode(trg_lines_[i], trg_ids[i]);
+  });
+  return num_pairs;
+}
+
+TextCorpus::TextCorpus(const string &src_path,
+                       const string &trg_path,
+                       std::shared_ptr<const LineIndex> src_index,
+                       std::shared_ptr<const LineIndex> trg_index,
+                       std::shared_ptr<const PieceEncoder> src_encoder,
+                       std::shared_ptr<const PieceEncoder> trg_encoder,
+                       const CorpusOptions &options)
+    : LineCorpus(std::move(src_encoder), std::move(trg_encoder), options),
+      src_file_(std::ifstream(src_path)),
+      trg_file_(std::ifstream(trg_path)),
+      src_index_(std::move(src_index)),
+      trg_index_(std::move(trg_index)),
+      begin_line_(std::min(src_index_->size(), trg_index_->size()) * options.shard / options.num_shards),
+      end_line_(std::min(src_index_->size(), trg_index_->size()) * (options.shard + 1) / options.num_shards),
+      blocks_(begin_line_, end_line_, options) {
+  if(src_index_->size() != trg_index_->size() && options.shard == 0) {
+    spdlog::warn("{} has {} lines but {} has {}. Extra lines are ignored",
+                 src_path, src_index_->size(), trg_path, trg_index_->size());
+  }
+}
+
+// Reads the next pair of lines, moving on to the next block when needed
+bool TextCorpus::read_lines(string &src_line, string &trg_line) {
+  while(block_lines_left_ == 0) {
+    size_t first, last;
+    if(!blocks_.next_block(first, last)) {
+      return false;
+    }
+    seek(first);
+    block_lines_left_ = last - first;
+  }
+  if(!std::getline(src_file_, src_line) || !std::getline(trg_file_, trg_line)) {
+    return false;
+  }
+  --block_lines_left_;
+  return true;
+}
+
+void TextCorpus::reset() {
+  blocks_.reset();
+  block_lines_left_ = 0;
+}
+
+// Epoch, blocks started, lines left in the current block
+vector<int64_t> TextCorpus::state() const {
+  return {static_cast<int64_t>(blocks_.epoch()),
+          static_cast<int64_t>(blocks_.blocks_started()),
+          static_cast<int64_t>(block_lines_left_)};
+}
+
+// Seeks straight to the saved line through the line index
+void TextCorpus::restore(const vector<int64_t> &state) {
+  if(state.size() != 3) {
+    return;
+  }
+  size_t first, last;
+  block_lines_left_ = 0;
+  if(blocks_.restore(state[0], state[1], first, last) && state[2] > 0) {
+    block_lines_left_ = std::min<size_t>(state[2], last - first);
+    seek(last - block_lines_left_);
+  }
+}
+
+void TextCorpus::seek(size_t line) {
+  src_file_.clear();
+  trg_file_.clear();
+  src_file_.seekg(src_index_->offset(line), std::ios::beg);
+  trg_file_.seekg(trg_index_->offset(line), std::ios::beg);
+}
+
+StreamTextCorpus::StreamTextCorpus(const string &src_path,
+                                   const string &trg_path,
+                                   std::shared_ptr<const PieceEncoder> src_encoder,
+                                   std::shared_ptr<const PieceEncoder> trg_encoder,
+                                   const CorpusOptions &options)
+    : LineCorpus(std::move(src_encoder), std::move(trg_encoder), options),
+      src_reader_(src_path),
+      trg_reader_(trg_path),
+      shard_(options.shard),
+      num_shards_(options.num_shards),
+      window_size_(std::max<size_t>(options.shuffle_block, 1)),
+      shuffle_(options.shuffle_block > 1),
+      // Different shards shuffle differently
+      seed_(options.seed + options.shard) {
+  if(shuffle_ && options.shard == 0) {
+    spdlog::info("Training data is read as a stream, pairs are only shuffled within blocks of {}", window_size_);
+  }
+}
+
+// Next pair of this shard from the files, skipping the lines of other shards
+bool StreamTextCorpus::read_shard_lines(string &src_line, string &trg_line) {
+  while(!ended_) {
+    bool src_read = src_reader_.getline(src_line);
+    bool trg_read = trg_reader_.getline(trg_line);
+    at_start_ = false;
+    if(src_read != trg_read && !warned_ && shard_ == 0) {
+      spdlog::warn("{} and {} have different numbers of lines. Extra lines are ignored",
+                   src_reader_.path(), trg_reader_.path());
+      warned_ = true;
+    }
+    if(!src_read || !trg_read) {
+      ended_ = true;
+      break;
+    }
+    if(line_++ % num_shards_ == shard_) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads the next window of pairs and shuffles it, seeded by its position so
+// that restore() can recreate it
+bool StreamTextCorpus::fill_window() {
+  window_src_.resize(window_size_);
+  window_trg_.resize(window_size_);
+  size_t size = 0;
+  while(size < window_size_ && read_shard_lines(window_src_[size], window_trg_[size])) {
+    ++size;
+  }
+  window_order_.resize(size);
+  std::iota(window_order_.begin(), window_order_.end(), 0);
+  if(shuffle_) {
+    std::seed_seq seed{seed_, static_cast<uint64_t>(epoch_), static_cast<uint64_t>(windows_started_)};
+    std::shuffle(window_order_.begin(), window_order_.end(), std::mt19937_64(seed));
+  }
+  window_next_ = 0;
+  ++windows_started_;
+  return size > 0;
+}
+
+bool StreamTextCorpus::read_lines(string &src_line, string &trg_line) {
+  if(window_next_ >= window_order_.size() && !fill_window()) {
+    return false;
+  }
+  size_t i = window_order_[window_next_++];
+  src_line.swap(window_src_[i]);
+  trg_line.swap(window_trg_[i]);
+  return true;
+}
+
+// The readers are only reopened if they have moved, so that the first reset
+// keeps what they decompressed since the constructor
+void StreamTextCorpus::reset() {
+  ++epoch_;
+  if(!at_start_) {
+    src_reader_.reopen();
+    trg_reader_.reopen();
+    at_start_ = true;
+  }
+  line_ = 0;
+  ended_ = false;
+  window_order_.clear();
+  window_next_ = 0;
+  windows_started_ = 0;
+}
+
+// Epoch, windows started, pairs taken from the current window
+vector<int64_t> StreamTextCorpus::state() const {
+  return {static_cast<int64_t>(epoch_),
+          static_cast<int64_t>(windows_started_),
+          static_cast<int64_t>(window_next_)};
+}
+
+// Reads the files again up to the saved window, since they cannot be seeked
+void StreamTextCorpus::restore(const vector<int64_t> &state) {
+  if(state.size() != 3) {
+    return;
+  }
+  reset();
+  epoch_ = state[0];
+  string src_line, trg_line;
+  for(int64_t window = 0; window + 1 < state[1]; ++window) {
+    for(size_t i = 0; i < window_size_ && read_shard_lines(src_line, trg_line); ++i) {}
+    ++windows_started_;
+  }
+  if(state[1] > 0 && fill_window()) {
+    window_next_ = std::min<size_t>(state[2], window_order_.size());
+  }
+}
+
+PipeCorpus::PipeCorpus(const string &path,
+                       std::shared_ptr<const PieceEncoder> src_encoder,
+                       std::shared_ptr<const PieceEncoder> trg_encoder,
+                       size_t reservoir_size,
+                       const CorpusOptions &options)
+    : LineCorpus(std::move(src_encoder), std::move(trg_encoder), options),
+      reader_(path),
+      reservoir_size_(reservoir_size),
+      generator_(options.seed + options.shard) {
+  reservoir_src_.reserve(reservoir_size_);
+  reservoir_trg_.reserve(reservoir_size_);
+}
+
+// Next well-formed pair of the stream
+bool PipeCorpus::read_stream(string &src_line, string &trg_line) {
+  while(!ended_) {
+    if(!reader_.getline(line_)) {
+      ended_ = true;
+      spdlog::info("End of training data stream {}", reader_.path());
+      break;
+    }
+    size_t tab = line_.find('\t');
+    if(tab == string::npos) {
+      if(malformed_++ == 0) {
+        spdlog::warn("Skipping lines without a tab in {}", reader_.path());
+      }
+      continue;
+    }
+    src_line.assign(line_, 0, tab);
+    trg_line.assign(line_, tab + 1, string::npos);
+    return true;
+  }
+  return false;
+}
+
+// Next pair out of the reservoir, which is refilled from the stream
+bool PipeCorpus::read_lines(string &src_line, string &trg_line) {
+  if(reservoir_size_ == 0) {
+    return read_stream(src_line, trg_line);
+  }
+  while(reservoir_src_.size() < reservoir_size_ && !ended_) {
+    reservoir_src_.emplace_back();
+    reservoir_trg_.emplace_back();
+    if(!read_stream(reservoir_src_.back(), reservoir_trg_.back())) {
+      reservoir_src_.pop_back();
+      reservoir_trg_.pop_back();
+    }
+  }
+  if(reservoir_src_.empty()) {
+    return false;
+  }
+  size_t i = std::uniform_int_distribution<size_t>(0, reservoir_src_.size() - 1)(generator_);
+  src_line.swap(reservoir_src_[i]);
+  trg_line.swap(reservoir_trg_[i]);
+  if(!read_stream(reservoir_src_[i], reservoir_trg_[i])) {
+    // Drain the reservoir once the stream has ended
+    reservoir_src_[i].swap(reservoir_src_.back());
+    reservoir_trg_[i].swap(reservoir_trg_.back());
+    reservoir_src_.pop_back();
+    reservoir_trg_.pop_back();
+  }
+  return true;
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <cstdint>
+#include <random>
+#include "piece_encoder.h"
+#include "thread_pool.h"
+#include "line_index.h"
+#include "line_reader.h"
+
+using std::string;
+using std::vector;
+
+// Reading settings shared by the corpus types
+struct CorpusOptions {
+  // Read only shard `shard` out of `num_shards` equal shards
+  size_t shard = 0;
+  size_t num_shards = 1;
+  // Pairs per block when shuffling, 0 to read in order
+  size_t shuffle_block = 0;
+  uint64_t seed = 0;
+  // Only used when encoding text
+  size_t encode_threads = 1;
+};
+
+// Visits the items in [begin, end) block by block.
+// With shuffling, the order of the blocks is permuted every epoch, while
+// items within a block stay in order so that reading remains mostly sequential
+class BlockShuffler {
+ public:
+  BlockShuffler(size_t begin, size_t end, const CorpusOptions &options);
+  // Gets the next range [first, last) of items. Returns false at the end of the epoch
+  bool next_block(size_t &first, size_t &last);
+  // Starts the next epoch
+  void reset();
+  size_t epoch() const { return epoch_; }
+  size_t blocks_started() const { return next_; }
+  // Returns to epoch `epoch` after blocks_started blocks have been taken.
+  // Sets [first, last) to the range of the last of these blocks, if any
+  bool restore(size_t epoch, size_t blocks_started, size_t &first, size_t &last);
+
+ private:
+  const size_t begin_;
+  const size_t end_;
+  const size_t block_size_;
+  const bool shuffle_;
+  const uint64_t seed_;
+  size_t epoch_ = 0;
+  vector<size_t> order_;
+  size_t next_ = 0;
+
+  void start_epoch();
+};
+
+// Ids of one sentence held elsewhere, e.g. in a vector or a memory-mapped corpus
+struct IdSpan {
+  const int *data = nullptr;
+  size_t size = 0;
+
+  IdSpan() = default;
+  IdSpan(const int *data, size_t size) : data(data), size(size) {}
+  IdSpan(const vector<int> &ids) : data(ids.data()), size(ids.size()) {}
+  const int *begin() const { return data; }
+  const int *end() const { return data + size; }
+};
+
+// Source of encoded sentence pairs consumed by MaxiBatch::fill
+class Corpus {
+ public:
+  virtual ~Corpus() = default;
+  // Reads the next pair into src_ids and trg_ids.
+  // Returns false once the corpus is exhausted
+  virtual bool next(vector<int> &src_ids, vector<int> &trg_ids) = 0;
+  // Reads up to max_pairs pairs into the first elements of src_ids and trg_ids,
+  // growing them if needed. Returns the number of pairs read
+  virtual size_t read(size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids);
+  // Whether read_views() is supported, for corpora holding their ids in memory
+  virtual bool has_views() const { return false; }
+  // Like read(), but points src_ids and trg_ids to ids held by the corpus
+  // instead of copying them. The views stay valid while the corpus exists
+  virtual size_t read_views(size_t /*max_pairs*/, vector<IdSpan> &/*src_ids*/, vector<IdSpan> &/*trg_ids*/) {
+    return 0;
+  }
+  // Rewinds to the beginning of the corpus, for the next epoch
+  virtual void reset() = 0;
+  // Number of pairs per epoch, if known
+  virtual std::optional<size_t> size() const { return std::nullopt; }
+  // Reading position, for resuming from a checkpoint. Empty if not supported
+  virtual vector<int64_t> state() const { return {}; }
+  // Moves to a position returned by state()
+  virtual void restore(const vector<int64_t> &/*state*/) {}
+};
+
+// Pairs of text lines encoded with SentencePiece on the fly. Subclasses only
+// fetch the lines, through read_lines(). read() fetches the lines of a whole
+// batch first and then encodes them across encode_threads threads
+class LineCorpus : public Corpus {
+ public:
+  LineCorpus(std::shared_ptr<const PieceEncoder> src_encoder,
+             std::shared_ptr<const PieceEncoder> trg_encoder,
+             const CorpusOptions &options);
+  bool next(vector<int> &src_ids, vector<int> &trg_ids) override;
+  size_t read(size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) override;
+
+ protected:
+  // Reads the next pair of lines. Returns false once the corpus is exhausted
+  virtual bool read_lines(string &src_line, string &trg_line) = 0;
+
+ private:
+  std::shared_ptr<const PieceEncoder> src_encoder_;
+  std::shared_ptr<const PieceEncoder> trg_encoder_;
+  string src_line_, trg_line_;
+  vector<string> src_lines_, trg_lines_;
+  std::unique_ptr<ThreadPool> encode_pool_;
+};
+
+// Parallel plain text files, encoded with SentencePiece on the fly.
+// Lines are located through the LineIndex of each file, which gives random
+// access for sharding and shuffling
+class TextCorpus : public LineCorpus {
+ public:
+  TextCorpus(const string &src_path,
+             const string &trg_path,
+             std::shared_ptr<const LineIndex> src_index,
+             std::shared_ptr<const LineIndex> trg_index,
+             std::shared_ptr<const PieceEncoder> src_encoder,
+             std::shared_ptr<const PieceEncoder> trg_encoder,
+             const CorpusOptions &options={});
+  void reset() override;
+  std::optional<size_t> size() const override { return end_line_ - begin_line_; }
+  vector<int64_t> state() const override;
+  void restore(const vector<int64_t> &state) override;
+
+ private:
+  std::ifstream src_file_;
+  std::ifstream trg_file_;
+  std::shared_ptr<const LineIndex> src_index_;
+  std::shared_ptr<const LineIndex> trg_index_;
+  size_t begin_line_;
+  size_t end_line_;
+  BlockShuffler blocks_;
+  size_t block_lines_left_ = 0;
+
+  bool read_lines(string &src_line, string &trg_line) override;
+  void seek(size_t line);
+};
+
+// Parallel text files read front to back through LineReaders, for compressed
+// files that cannot be indexed. Line i belongs to shard i % num_shards, so every
+// shard reads the whole files. Shuffling is limited to windows of shuffle_block
+// pairs, and reset() reopens the files
+class StreamTextCorpus : public LineCorpus {
+ public:
+  StreamTextCorpus(const string &src_path,
+                   const string &trg_path,
+                   std::shared_ptr<const PieceEncoder> src_encoder,
+                   std::shared_ptr<const PieceEncoder> trg_encoder,
+                   const CorpusOptions &options={});
+  void reset() override;
+  vector<int64_t> state() const override;
+  void restore(const vector<int64_t> &state) override;
+
+ private:
+  LineReader src_reader_;
+  LineReader trg_reader_;
+  const size_t shard_;
+  const size_t num_shards_;
+  const size_t window_size_;
+  const bool shuffle_;
+  const uint64_t seed_;
+  size_t epoch_ = 0;
+  size_t line_ = 0;
+  bool ended_ = false;
+  // Nothing read since the readers were opened
+  bool at_start_ = true;
+  // The line count mismatch is only reported once
+  bool warned_ = false;
+  // Pairs of the current window, taken in window_order_
+  vector<string> window_src_, window_trg_;
+  vector<size_t> window_order_;
+  size_t window_next_ = 0;
+  size_t windows_started_ = 0;
+
+  bool read_lines(string &src_line, string &trg_line) override;
+  bool read_shard_lines(string &src_line, string &trg_line);
+  bool fill_window();
+};
+
+// Tab-separated sentence pairs from standard input ("-") or a named pipe, for
+// training on a stream with no fixed size and no epochs.
+// Pairs pass through a shuffle reservoir of reservoir_size pairs: every pair
+// read takes the place of a random pair in the reservoir, which is passed on.
+// Memory therefore stays bounded however long the stream runs. Not resumable
+class PipeCorpus : public LineCorpus {
+ public:
+  PipeCorpus(const string &path,
+             std::shared_ptr<const PieceEncoder> src_encoder,
+             std::shared_ptr<const PieceEncoder> trg_encoder,
+             size_t reservoir_size,
+             const CorpusOptions &options={});
+  // A stream cannot be rewound
+  void reset() override {}
+
+ private:
+  LineReader reader_;
+  const size_t reservoir_size_;
+  vector<string> reservoir_src_, reservoir_trg_;
+  std::mt19937_64 generator_;
+  bool ended_ = false;
+  size_t malformed_ = 0;
+  string line_;
+
+  bool read_stream(string &src_line, string &trg_line);
+  bool read_lines(string &src_line, string &trg_line) override;
+};
@@ -0,0 +1,224 @@
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include "corpus_stats.h"
+#include "line_index.h"
+#include "line_reader.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+namespace {
+[[noreturn]] void stats_error(const string &message) {
+  spdlog::error(message);
+  throw std::runtime_error(message);
+}
+
+// Plain text file mapped for scanning, with the offsets of its lines
+class IndexedText {
+ public:
+  explicit IndexedText(const string &path) {
+    if(LineReader::is_compressed(path)) {
+      stats_error(fmt::format("{} is compressed. Corpus statistics need plain text files, which can be memory-mapped",
+                              path));
+    }
+    if(!text_.map(path)) {
+      stats_error(fmt::format("Could not map {}: {}", path, std::strerror(errno)));
+    }
+    text_.advise_sequential();
+    index_ = std::make_unique<LineIndex>(path);
+  }
+
+  size_t lines() const { return index_->size(); }
+
+  // Copies line i into line, without its newline
+  void read_line(size_t i, string &line) const {
+    const char *begin = text_.data() + index_->offset(i);
+    const char *end = text_.data() + index_->offset(i + 1);
+    if(end > begin && end[-1] == '\n') {
+      --end;
+    }
+    line.assign(begin, end);
+  }
+
+ private:
+  MappedFile text_;
+  std::unique_ptr<LineIndex> index_;
+};
+
+void add_line(SideStats &side, const string &line, const vector<int> &ids) {
+  side.tokens += ids.size();
+  side.empty_lines += line.empty();
+  side.max_length = std::max(side.max_length, ids.size());
+  ++side.length_histogram[std::min(ids.size(), CorpusStats::kMaxLength)];
+  for(int id : ids) {
+    if(id >= 0 && static_cast<size_t>(id) < side.piece_counts.size()) {
+      ++side.piece_counts[id];
+    }
+  }
+}
+
+SideStats empty_side(const PieceEncoder &encoder) {
+  SideStats side;
+  side.length_histogram.resize(CorpusStats::kMaxLength + 1);
+  side.piece_counts.resize(encoder.processor().GetPieceSize());
+  return side;
+}
+
+// Smallest bin holding at least the given fraction of the counts
+size_t percentile_bin(const vector<uint64_t> &histogram, double fraction) {
+  uint64_t total = 0;
+  for(uint64_t count : histogram) {
+    total += count;
+  }
+  uint64_t seen = 0;
+  for(size_t bin = 0; bin < histogram.size(); ++bin) {
+    seen += histogram[bin];
+    if(seen > 0 && seen >= fraction * total) {
+      return bin;
+    }
+  }
+  return 0;
+}
+
+const vector<std::pair<const char*, double>> kPercentiles = {
+    {"p50", 0.5}, {"p90", 0.9}, {"p95", 0.95}, {"p99", 0.99}, {"p99.9", 0.999}};
+
+// Histogram as a JSON array, without trailing empty bins
+string json_array(const vector<uint64_t> &histogram) {
+  size_t size = histogram.size();
+  while(size > 0 && histogram[size - 1] == 0) {
+    --size;
+  }
+  string array = "[";
+  for(size_t bin = 0; bin < size; ++bin) {
+    array += (bin > 0 ? "," : "") + std::to_string(histogram[bin]);
+  }
+  return array + "]";
+}
+
+void write_side_json(std::ostream &out, const SideStats &side, uint64_t lines) {
+  uint64_t pieces_used = std::count_if(side.piece_counts.begin(), side.piece_counts.end(),
+                                       [](uint64_t count) { return count > 0; });
+  out << fmt::format("{{\n    \"tokens\": {},\n    \"mean_length\": {:.4g},\n    \"max_length\": {},\n"
+                     "    \"empty_lines\": {},\n",
+                     side.tokens, lines > 0 ? static_cast<double>(side.tokens) / lines : 0.0, side.max_length,
+                     side.empty_lines);
+  out << "    \"length_percentiles\": {";
+  for(size_t i = 0; i < kPercentiles.size(); ++i) {
+    out << fmt::format("{}\"{}\": {}", i > 0 ? ", " : "", kPercentiles[i].first,
+                       percentile_bin(side.length_histogram, kPercentiles[i].second));
+  }
+  out << "},\n";
+  out << fmt::format("    \"length_histogram\": {},\n", json_array(side.length_histogram));
+  out << fmt::format("    \"unknown_tokens\": {},\n    \"unknown_rate\": {:.6g},\n"
+                     "    \"vocab_size\": {},\n    \"pieces_used\": {},\n    \"vocab_coverage\": {:.6g}\n  }}",
+                     side.unknown_tokens,
+                     side.tokens > 0 ? static_cast<double>(side.unknown_tokens) / side.tokens : 0.0,
+                     side.piece_counts.size(),
+                     pieces_used,
+                     side.piece_counts.empty() ? 0.0 : static_cast<double>(pieces_used) / side.piece_counts.size());
+}
+
+void merge_histogram(vector<uint64_t> &histogram, const vector<uint64_t> &other) {
+  histogram.resize(std::max(histogram.size(), other.size()));
+  for(size_t bin = 0; bin < other.size(); ++bin) {
+    histogram[bin] += other[bin];
+  }
+}
+} // namespace
+
+SideStats &SideStats::operator+=(const SideStats &other) {
+  tokens += other.tokens;
+  unknown_tokens += other.unknown_tokens;
+  empty_lines += other.empty_lines;
+  max_length = std::max(max_length, other.max_length);
+  merge_histogram(length_histogram, other.length_histogram);
+  merge_histogram(piece_counts, other.piece_counts);
+  return *this;
+}
+
+CorpusStats &CorpusStats::operator+=(const CorpusStats &other) {
+  lines += other.lines;
+  src += other.src;
+  trg += other.trg;
+  merge_histogram(ratio_histogram, other.ratio_histogram);
+  return *this;
+}
+
+void CorpusStats::write_json(std::ostream &out) const {
+  out << fmt::format("{{\n  \"lines\": {},\n  \"src\": ", lines);
+  write_side_json(out, src, lines);
+  out << ",\n  \"trg\": ";
+  write_side_json(out, trg, lines);
+  // Bins are reported by their upper edge
+  out << fmt::format(",\n  \"length_ratio\": {{\n    \"bin_width\": {},\n    \"percentiles\": {{", kRatioBinWidth);
+  for(size_t i = 0; i < kPercentiles.size(); ++i) {
+    out << fmt::format("{}\"{}\": {:.4g}", i > 0 ? ", " : "", kPercentiles[i].first,
+                       (percentile_bin(ratio_histogram, kPercentiles[i].second) + 1) * kRatioBinWidth);
+  }
+  out << fmt::format("}},\n    \"histogram\": {}\n  }}\n}}\n", json_array(ratio_histogram));
+}
+
+CorpusStats scan_corpus(const string &src_path,
+                        const string &trg_path,
+                        const PieceEncoder &src_encoder,
+                        const PieceEncoder &trg_encoder,
+                        size_t threads) {
+  if(threads == 0) {
+    threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+  ThreadPool pool(threads);
+  IndexedText src_text(src_path), trg_text(trg_path);
+  size_t num_lines = std::min(src_text.lines(), trg_text.lines());
+  if(src_text.lines() != trg_text.lines()) {
+    spdlog::warn("{} has {} lines but {} has {}. Extra lines are ignored",
+                 src_path, src_text.lines(), trg_path, trg_text.lines());
+  }
+  spdlog::info("Scanning {} sentence pairs on {} threads", num_lines, threads);
+
+  // One range of lines per thread
+  CorpusStats empty_stats;
+  empty_stats.src = empty_side(src_encoder);
+  empty_stats.trg = empty_side(trg_encoder);
+  empty_stats.ratio_histogram.resize(CorpusStats::kRatioBins);
+  vector<CorpusStats> range_stats(threads, empty_stats);
+  pool.parallel_for(threads, [&](size_t range) {
+    uint64_t first = num_lines * range / threads;
+    uint64_t last = num_lines * (range + 1) / threads;
+    string src_line, trg_line;
+    vector<int> src_ids, trg_ids;
+    CorpusStats &stats = range_stats[range];
+    for(uint64_t line = first; line < last; ++line) {
+      src_text.read_line(line, src_line);
+      trg_text.read_line(line, trg_line);
+      src_encoder.encode(src_line, src_ids);
+      trg_encoder.encode(trg_line, trg_ids);
+      add_line(stats.src, src_line, src_ids);
+      add_line(stats.trg, trg_line, trg_ids);
+      if(!src_ids.empty()) {
+        double ratio = static_cast<double>(trg_ids.size()) / src_ids.size();
+        ++stats.ratio_histogram[std::min(static_cast<size_t>(ratio / CorpusStats::kRatioBinWidth),
+                                         CorpusStats::kRatioBins - 1)];
+      }
+      ++stats.lines;
+    }
+  });
+
+  CorpusStats stats = range_stats[0];
+  for(size_t range = 1; range < threads; ++range) {
+    stats += range_stats[range];
+  }
+  // Counted per piece, which is cheaper than checking every token
+  for(auto [side, encoder] : {std::make_pair(&stats.src, &src_encoder), std::make_pair(&stats.trg, &trg_encoder)}) {
+    for(size_t id = 0; id < side->piece_counts.size(); ++id) {
+      if(encoder->processor().IsUnknown(id)) {
+        side->unknown_tokens += side->piece_counts[id];
+      }
+    }
+  }
+  return stats;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "piece_encoder.h"
+
+using std::string;
+using std::vector;
+
+// Token statistics of one side of a parallel corpus. Lengths count eos, as
+// --max-length does
+struct SideStats {
+  uint64_t tokens = 0;
+  uint64_t unknown_tokens = 0;
+  uint64_t empty_lines = 0;
+  size_t max_length = 0;
+  // Lines per length, longer lines are counted in the last bin
+  vector<uint64_t> length_histogram;
+  // Occurrences of each piece id
+  vector<uint64_t> piece_counts;
+
+  SideStats &operator+=(const SideStats &other);
+};
+
+// Statistics of a parallel corpus written by `mtness stats`
+struct CorpusStats {
+  static constexpr size_t kMaxLength = 1024;
+  static constexpr double kRatioBinWidth = 0.05;
+  static constexpr size_t kRatioBins = 200;
+
+  uint64_t lines = 0;
+  SideStats src;
+  SideStats trg;
+  // Lines per target/source length ratio, in bins of kRatioBinWidth.
+  // Higher ratios are counted in the last bin
+  vector<uint64_t> ratio_histogram;
+
+  CorpusStats &operator+=(const CorpusStats &other);
+  void write_json(std::ostream &out) const;
+};
+
+// Encodes a pair of plain text files with the given encoders and gathers their
+// statistics. The files are memory-mapped and split into ranges of lines
+// scanned by `threads` threads, so even huge corpora are read once at disk speed
+CorpusStats scan_corpus(const string &src_path,
+                        const string &trg_path,
+                        const PieceEncoder &src_encoder,
+                        const PieceEncoder &trg_encoder,
+                        size_t threads);
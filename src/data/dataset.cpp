@@ -1,112 +1,572 @@
+#include <spdlog/spdlog.h>
 #include <algorithm>
+#include <limits>
+#include <cmath>
+#include <tuple>
 #include "dataset.h"
 
 void MaskedData::to(const torch::DeviceType &device, const bool non_blocking) {
   data = data.to(device, non_blocking);
   mask = mask.to(device, non_blocking);
   lengths = lengths.to(device, non_blocking);
+  if(reverse_index.defined()) {
+    reverse_index = reverse_index.to(device, non_blocking);
+  }
 }
 
-TranslationDataset::TranslationDataset(const string& src_path,
-                                       const string& trg_path,
-                                       std::unique_ptr<SentencePieceProcessor> src_spm_processor,
-                                       std::unique_ptr<SentencePieceProcessor> trg_spm_processor,
-                                       const size_t& maxibatch_size,
-                                       const MaxiBatchSortKey sort,
-                                       bool reverse_src)
-    : src_file_(std::ifstream(src_path)),
-      trg_file_(std::ifstream(trg_path)),
-      src_spm_processor_(std::move(src_spm_processor)),
-      trg_spm_processor_(std::move(trg_spm_processor)),
-      maxi_batch_(maxibatch_size, sort) {
-  if(reverse_src) {
-    // Reverse source sentence (e.g. for Sutskever-style models)
-    src_spm_processor_->SetEncodeExtraOptions("reverse:eos");
-  }
-}
-
-torch::optional<std::vector<Example<MaskedData, MaskedData>>> TranslationDataset::get_batch(const size_t batch_size) {
-  std::vector<Example<MaskedData, MaskedData>> batch;
-  if(maxi_batch_.empty()) {
-    maxi_batch_.fill(src_file_, trg_file_, src_spm_processor_, trg_spm_processor_, batch_size);
-  }
-  batch.reserve(batch_size);
-  while(batch.size() < batch_size && !maxi_batch_.empty()) {
-    const auto [src_ids, trg_ids] = maxi_batch_.pop();
-    batch.emplace_back(MaskedData(torch::tensor(src_ids),
-                                  torch::ones(src_ids.size(), torch::dtype(torch::kBool)),
-                                  src_ids.size()),
-                       MaskedData(torch::tensor(trg_ids),
-                                  torch::ones(trg_ids.size(), torch::dtype(torch::kBool)),
-                                  trg_ids.size()));
-  }
-  if(batch.size() == 0 && src_file_.eof() && trg_file_.eof()) {
-    // End of epoch
-    return torch::optional<std::vector<Example<MaskedData, MaskedData>>>();
+TranslationDataset::TranslationDataset(const TrainingOptions &training_options,
+                                       vector<std::unique_ptr<Corpus>> shard_corpora) {
+  for(auto &corpus : shard_corpora) {
+    shards_.emplace_back(std::make_unique<Shard>(training_options, std::move(corpus)));
+  }
+}
+
+// Shards are taken round-robin, so with as many torch DataLoader workers as
+// shards each worker mostly reads its own shard. Exhausted shards are skipped
+// and the epoch only ends once all of them are exhausted
+torch::optional<Example<MaskedData, MaskedData>> TranslationDataset::get_batch(const size_t batch_size) {
+  size_t first = next_shard_.fetch_add(1);
+  for(size_t i = 0; i < shards_.size(); ++i) {
+    auto batch = get_shard_batch((first + i) % shards_.size(), batch_size);
+    if(batch) {
+      return batch;
+    }
+  }
+  // End of epoch
+  return torch::optional<Example<MaskedData, MaskedData>>();
+}
+
+torch::optional<Example<MaskedData, MaskedData>> TranslationDataset::get_shard_batch(size_t shard_index,
+                                                                                     size_t batch_size) {
+  Shard &shard = *shards_[shard_index];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if(shard.exhausted) {
+    return torch::optional<Example<MaskedData, MaskedData>>();
+  }
+  auto batch = shard.reader.get_batch(batch_size);
+  if(!batch) {
+    shard.exhausted = true;
   }
   return batch;
 }
 
+DatasetShard::DatasetShard(const TrainingOptions &training_options,
+                           std::unique_ptr<Corpus> corpus)
+    : corpus_(std::move(corpus)),
+      maxibatch_size_(training_options.maxibatch_size),
+      maxi_sort_(training_options.maxi_sort),
+      length_filter_{training_options.max_length, training_options.max_length_mode, training_options.max_length_ratio},
+      maxibatch_bytes_(training_options.maxibatch_mb << 20),
+      target_padding_(training_options.target_padding / 100),
+      batch_tokens_(training_options.batch_tokens),
+      batch_tokens_side_(training_options.batch_tokens_side),
+      prefetch_(training_options.prefetch_maxibatches),
+      prefetch_queue_(training_options.prefetch_maxibatches),
+      recycled_(training_options.prefetch_maxibatches + 1) {
+  maxi_batch_ = new_maxi_batch();
+}
+
+DatasetShard::~DatasetShard() {
+  stop_prefetch();
+}
+
+torch::optional<Example<MaskedData, MaskedData>> DatasetShard::get_batch(const size_t batch_size) {
+  if(maxi_batch_->empty()) {
+    next_maxi_batch(batch_size);
+  }
+  batch_pairs_.clear();
+  size_t src_max = 0, trg_max = 0;
+  while(!maxi_batch_->empty()) {
+    if(batch_tokens_ == 0) {
+      // Fixed number of sentences per batch
+      if(batch_pairs_.size() >= batch_size) {
+        break;
+      }
+    }
+    else {
+      // Stop before the padded batch would exceed the token budget.
+      // A single pair is always accepted, even if it is over budget on its own
+      size_t next = maxi_batch_->front();
+      size_t next_src_max = std::max(src_max, maxi_batch_->length(next, 0));
+      size_t next_trg_max = std::max(trg_max, maxi_batch_->length(next, 1));
+      if(!batch_pairs_.empty() && padded_tokens(next_src_max, next_trg_max, batch_pairs_.size() + 1) > batch_tokens_) {
+        break;
+      }
+      src_max = next_src_max;
+      trg_max = next_trg_max;
+    }
+    batch_pairs_.push_back(maxi_batch_->pop());
+  }
+  if(batch_pairs_.empty()) {
+    // End of epoch
+    return torch::optional<Example<MaskedData, MaskedData>>();
+  }
+  if(target_padding_ > 0) {
+    size_t src_tokens = 0, trg_tokens = 0;
+    src_max = trg_max = 0;
+    for(size_t i : batch_pairs_) {
+      src_tokens += maxi_batch_->length(i, 0);
+      trg_tokens += maxi_batch_->length(i, 1);
+      src_max = std::max(src_max, maxi_batch_->length(i, 0));
+      trg_max = std::max(trg_max, maxi_batch_->length(i, 1));
+    }
+    real_tokens_ += src_tokens + trg_tokens;
+    padded_tokens_ += (src_max + trg_max) * batch_pairs_.size();
+  }
+  return PadAndStack<>::collate(MaxiBatchSelection{*maxi_batch_, batch_pairs_});
+}
+
+// Replaces the exhausted maxi_batch_ with the next one.
+// maxi_batch_ stays empty at the end of the epoch
+void DatasetShard::next_maxi_batch(size_t batch_size) {
+  adapt_maxi_batch_size(batch_size);
+  if(prefetch_ == 0) {
+    // Fill on the calling thread
+    fill(*maxi_batch_, batch_size);
+    return;
+  }
+  if(!prefetch_thread_.joinable()) {
+    start_prefetch(batch_size);
+  }
+  auto next = prefetch_queue_.pop();
+  if(next) {
+    // Hand the consumed maxi-batch back to the producer
+    recycled_.try_push(maxi_batch_);
+    maxi_batch_ = std::move(*next);
+  }
+  else if(prefetch_error_) {
+    // Producer failed, report it on the training thread
+    std::rethrow_exception(prefetch_error_);
+  }
+}
+
+// Fills and sorts maxi-batches in the background until the corpus is exhausted
+// or the queue is closed, blocking while prefetch_ maxi-batches are waiting
+void DatasetShard::start_prefetch(size_t batch_size) {
+  prefetch_queue_.reopen();
+  prefetch_error_ = nullptr;
+  prefetch_thread_ = std::thread([this, batch_size]() {
+    try {
+      while(true) {
+        auto maxi_batch = new_maxi_batch();
+        fill(*maxi_batch, batch_size);
+        if(maxi_batch->empty() || !prefetch_queue_.push(std::move(maxi_batch))) {
+          break;
+        }
+      }
+    }
+    catch(...) {
+      prefetch_error_ = std::current_exception();
+    }
+    prefetch_queue_.close();
+  });
+}
+
+// Grows maxi-batches while the batches cut from them are padded more than
+// target_padding_, since sorting more pairs at once groups more similar lengths,
+// and shrinks them again once padding is well below the target.
+// The byte budget, if any, still caps every maxi-batch. Without one, they grow to
+// at most kMaxTargetGrowth times --maxibatch-size batches, as padding may stay
+// above the target however many pairs are sorted together
+void DatasetShard::adapt_maxi_batch_size(size_t batch_size) {
+  if(target_padding_ <= 0 || padded_tokens_ == 0) {
+    return;
+  }
+  double padding = 1.0 - static_cast<double>(real_tokens_) / padded_tokens_;
+  size_t target = target_pairs_.load();
+  if(target == 0) {
+    target = maxi_batch_->size();
+  }
+  if(padding > target_padding_) {
+    // Only grow if the byte budget didn't already cut the last maxi-batch short
+    if(maxi_batch_->size() >= target) {
+      target = target * 5 / 4;
+      if(maxibatch_bytes_ == 0) {
+        target = std::min(target, kMaxTargetGrowth * maxibatch_size_ * batch_size);
+      }
+    }
+  }
+  else if(padding < target_padding_ / 2) {
+    target = std::max(target * 9 / 10, 2 * batch_size);
+  }
+  if(target != target_pairs_.load()) {
+    spdlog::debug("Padding {:.1f}%, target {:.1f}%. Maxi-batches now hold {} sentence pairs",
+                  100 * padding, 100 * target_padding_, target);
+  }
+  target_pairs_ = target;
+  real_tokens_ = padded_tokens_ = 0;
+}
+
+// Reuses a consumed maxi-batch if there is one, to avoid reallocating its buffers
+std::unique_ptr<MaxiBatch> DatasetShard::new_maxi_batch() {
+  auto recycled = recycled_.try_pop();
+  if(recycled) {
+    return std::move(*recycled);
+  }
+  return std::make_unique<MaxiBatch>(maxibatch_size_, maxi_sort_, length_filter_, maxibatch_bytes_);
+}
+
+void DatasetShard::fill(MaxiBatch &maxi_batch, size_t batch_size) {
+  maxi_batch.fill(*corpus_, batch_size, target_pairs_.load());
+  dropped_ += maxi_batch.dropped();
+  cropped_ += maxi_batch.cropped();
+}
+
+void DatasetShard::stop_prefetch() {
+  if(prefetch_thread_.joinable()) {
+    prefetch_queue_.close();
+    prefetch_thread_.join();
+  }
+}
+
+void DatasetShard::reset() {
+  stop_prefetch();
+  maxi_batch_->clear();
+  corpus_->reset();
+}
+
+void DatasetShard::save(torch::serialize::OutputArchive &archive) const {
+  maxi_batch_->save(archive);
+}
+
+void DatasetShard::load(torch::serialize::InputArchive &archive) {
+  stop_prefetch();
+  maxi_batch_->load(archive);
+  corpus_->restore(maxi_batch_->corpus_state());
+}
+
+// Number of tokens in a batch of num_sentences pairs once padded to
+// src_len and trg_len, counting only the side(s) in batch_tokens_side_
+size_t DatasetShard::padded_tokens(size_t src_len, size_t trg_len, size_t num_sentences) const {
+  switch(batch_tokens_side_) {
+    case BatchTokensSide::source:
+      return src_len * num_sentences;
+    case BatchTokensSide::target:
+      return trg_len * num_sentences;
+    default:
+      return (src_len + trg_len) * num_sentences;
+  }
+}
+
+// Number of sentence pairs per epoch, if known for all shards
 torch::optional<size_t> TranslationDataset::size() const {
-  return torch::optional<size_t>();
+  size_t total = 0;
+  for(const auto &shard : shards_) {
+    auto shard_size = shard->reader.size();
+    if(!shard_size) {
+      return torch::optional<size_t>();
+    }
+    total += *shard_size;
+  }
+  return total;
+}
+
+std::pair<size_t, size_t> TranslationDataset::take_filter_counts() {
+  size_t dropped = 0, cropped = 0;
+  for(auto &shard : shards_) {
+    dropped += shard->reader.take_dropped();
+    cropped += shard->reader.take_cropped();
+  }
+  return {dropped, cropped};
+}
+
+RingStats TranslationDataset::take_prefetch_stats() {
+  RingStats stats;
+  for(auto &shard : shards_) {
+    // Lock-free, so the trainer is never held up by a shard waiting for its prefetch thread
+    stats += shard->reader.take_prefetch_stats();
+  }
+  return stats;
 }
 
+// Each shard's corpus reshuffles on reset
 void TranslationDataset::reset() {
-  // TODO: There should be shuffling logic here later
-  src_file_.clear();
-  trg_file_.clear();
-  src_file_.seekg(0, std::ios::beg);
-  trg_file_.seekg(0, std::ios::beg);
+  if(skip_next_reset_) {
+    skip_next_reset_ = false;
+    return;
+  }
+  for(auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->reader.reset();
+    shard->exhausted = false;
+  }
+  next_shard_ = 0;
 }
 
+// Saves the reading position of every shard.
+// Batches already collated ahead by BatchPipeline are skipped after loading
 void TranslationDataset::save(torch::serialize::OutputArchive &archive) const {
-  // TODO
-  return;
+  archive.write("num_shards", torch::tensor(static_cast<int64_t>(shards_.size())));
+  for(size_t k = 0; k < shards_.size(); ++k) {
+    torch::serialize::OutputArchive shard_archive;
+    {
+      std::lock_guard<std::mutex> lock(shards_[k]->mutex);
+      shards_[k]->reader.save(shard_archive);
+    }
+    archive.write("shard" + std::to_string(k), shard_archive);
+  }
 }
 
 void TranslationDataset::load(torch::serialize::InputArchive &archive) {
-  // TODO
-  return;
+  Tensor num_shards;
+  archive.read("num_shards", num_shards);
+  if(num_shards.item<int64_t>() != static_cast<int64_t>(shards_.size())) {
+    spdlog::warn("Data position was saved with {} data workers, not {}. Starting from the beginning of the data",
+                 num_shards.item<int64_t>(), shards_.size());
+    return;
+  }
+  for(size_t k = 0; k < shards_.size(); ++k) {
+    torch::serialize::InputArchive shard_archive;
+    archive.read("shard" + std::to_string(k), shard_archive);
+    std::lock_guard<std::mutex> lock(shards_[k]->mutex);
+    shards_[k]->reader.load(shard_archive);
+    shards_[k]->exhausted = false;
+  }
+  skip_next_reset_ = true;
 }
 
-MaxiBatch::MaxiBatch(const size_t& maxibatch_size, const MaxiBatchSortKey sort)
-    : maxi_batch_({}), maxibatch_size_(maxibatch_size), sort_(sort) {}
+MaxiBatch::MaxiBatch(const size_t& maxibatch_size, const MaxiBatchSortKey sort, const LengthFilter &filter,
+                     size_t max_bytes)
+    : maxibatch_size_(maxibatch_size), sort_(sort), filter_(filter), max_bytes_(max_bytes) {}
 
-array<vector<int>, 2> MaxiBatch::pop() {
-  auto el = std::move(maxi_batch_.front());
-  maxi_batch_.pop_front();
-  return el;
+size_t MaxiBatch::memory_bytes() const {
+  return arena_bytes() + scratch_bytes_;
 }
 
-// Sorts the loaded batches according to sort_.
+size_t MaxiBatch::arena_bytes() const {
+  return ids16_.size() * sizeof(uint16_t) + ids32_.size() * sizeof(int32_t)
+         + offsets_.size() * sizeof(uint64_t) + (lengths_.size() + order_.size()) * sizeof(uint32_t);
+}
+
+// Read buffers keep their capacity from one read, and one fill, to the next
+size_t MaxiBatch::scratch_bytes() const {
+  size_t bytes = (src_buffer_.capacity() + trg_buffer_.capacity()) * sizeof(vector<int>)
+                 + (src_views_.capacity() + trg_views_.capacity()) * sizeof(IdSpan);
+  for(size_t i = 0; i < src_buffer_.size(); ++i) {
+    bytes += (src_buffer_[i].capacity() + trg_buffer_[i].capacity()) * sizeof(int);
+  }
+  return bytes;
+}
+
+// Keeps the allocated memory for the next fill
+void MaxiBatch::clear() {
+  ids16_.clear();
+  ids32_.clear();
+  offsets_.clear();
+  lengths_.clear();
+  order_.clear();
+  next_ = 0;
+}
+
+// Sentences longer than max_length, if not 0, are cropped to it
+void MaxiBatch::add_pair(IdSpan src_ids, IdSpan trg_ids, size_t max_length) {
+  size_t src_length = max_length > 0 ? std::min(src_ids.size, max_length) : src_ids.size;
+  size_t trg_length = max_length > 0 ? std::min(trg_ids.size, max_length) : trg_ids.size;
+  offsets_.push_back(wide_ids_ ? ids32_.size() : ids16_.size());
+  lengths_.push_back(src_length);
+  lengths_.push_back(trg_length);
+  order_.push_back(order_.size());
+  append_ids(src_ids, src_length);
+  append_ids(trg_ids, trg_length);
+}
+
+// Appends the first length ids. When cropping, the final id (eos) is kept at the end.
+// Switches to 32-bit storage for good once an id doesn't fit in 16 bits
+void MaxiBatch::append_ids(IdSpan ids, size_t length) {
+  if(!wide_ids_) {
+    bool fits = std::all_of(ids.begin(), ids.end(),
+                            [](int id) { return id >= 0 && id <= std::numeric_limits<uint16_t>::max(); });
+    if(!fits) {
+      ids32_.assign(ids16_.begin(), ids16_.end());
+      ids16_.clear();
+      ids16_.shrink_to_fit();
+      wide_ids_ = true;
+    }
+  }
+  bool cropped = length < ids.size;
+  const int *kept_end = ids.begin() + (cropped ? length - 1 : length);
+  if(wide_ids_) {
+    ids32_.insert(ids32_.end(), ids.begin(), kept_end);
+    if(cropped) {
+      ids32_.push_back(ids.end()[-1]);
+    }
+  }
+  else {
+    ids16_.insert(ids16_.end(), ids.begin(), kept_end);
+    if(cropped) {
+      ids16_.push_back(ids.end()[-1]);
+    }
+  }
+}
+
+void MaxiBatch::copy_ids(size_t i, int side, int64_t *out, int64_t stride) const {
+  size_t begin = offsets_[i] + (side == 0 ? 0 : lengths_[2 * i]);
+  size_t length = lengths_[2 * i + side];
+  if(wide_ids_) {
+    const int32_t *ids = ids32_.data() + begin;
+    for(size_t t = 0; t < length; ++t) {
+      out[t * stride] = ids[t];
+    }
+  }
+  else {
+    const uint16_t *ids = ids16_.data() + begin;
+    for(size_t t = 0; t < length; ++t) {
+      out[t * stride] = ids[t];
+    }
+  }
+}
+
+// Stores the remaining pairs as a {num_pairs, 2} tensor of lengths and all
+// their token ids concatenated
+void MaxiBatch::save(torch::serialize::OutputArchive &archive) const {
+  vector<int64_t> lengths, tokens;
+  lengths.reserve(2 * (order_.size() - next_));
+  for(size_t k = next_; k < order_.size(); ++k) {
+    size_t i = order_[k];
+    for(int side = 0; side < 2; ++side) {
+      size_t length = this->length(i, side);
+      lengths.push_back(length);
+      tokens.resize(tokens.size() + length);
+      copy_ids(i, side, tokens.data() + tokens.size() - length, 1);
+    }
+  }
+  archive.write("lengths", torch::tensor(lengths));
+  archive.write("tokens", torch::tensor(tokens));
+  archive.write("corpus_state", torch::tensor(corpus_state_));
+}
+
+void MaxiBatch::load(torch::serialize::InputArchive &archive) {
+  Tensor lengths, tokens, corpus_state;
+  archive.read("lengths", lengths);
+  archive.read("tokens", tokens);
+  archive.read("corpus_state", corpus_state);
+  const int64_t *lengths_ptr = lengths.data_ptr<int64_t>();
+  const int64_t *tokens_ptr = tokens.data_ptr<int64_t>();
+  clear();
+  vector<int> src_ids, trg_ids;
+  for(int64_t i = 0; i + 1 < lengths.numel(); i += 2) {
+    src_ids.assign(tokens_ptr, tokens_ptr + lengths_ptr[i]);
+    tokens_ptr += lengths_ptr[i];
+    trg_ids.assign(tokens_ptr, tokens_ptr + lengths_ptr[i + 1]);
+    tokens_ptr += lengths_ptr[i + 1];
+    add_pair(src_ids, trg_ids);
+  }
+  const int64_t *state_ptr = corpus_state.data_ptr<int64_t>();
+  corpus_state_.assign(state_ptr, state_ptr + corpus_state.numel());
+}
+
+// Sorts the pairs not yet popped according to sort_.
 // Order unchanged if sort_ is MaxiBatchSortKey::none
-void MaxiBatch::sort() {
+void MaxiBatch::sort(size_t num_batches) {
   if(sort_ == MaxiBatchSortKey::none) {
     // No sorting
     return;
   }
-  // Sort maxi_batch
-  int sort_key = sort_ == MaxiBatchSortKey::source ? 0 : 1;
-  std::sort(maxi_batch_.begin(),
-            maxi_batch_.end(),
-            [&sort_key](const auto& lhs, const auto& rhs) {
-                return lhs[sort_key].size() < rhs[sort_key].size();
-            });
-}
-
-void MaxiBatch::fill(std::ifstream &src_file,
-                     std::ifstream &trg_file,
-                     const std::unique_ptr<SentencePieceProcessor> &src_spm_processor,
-                     const std::unique_ptr<SentencePieceProcessor> &trg_spm_processor,
-                     const size_t &minibatch_size) {
-  string src_line, trg_line;
-  vector<int> src_ids, trg_ids;
-  while(maxi_batch_.size() < maxibatch_size_ * minibatch_size && !src_file.eof() && !trg_file.eof()) {
-    std::getline(src_file, src_line);
-    std::getline(trg_file, trg_line);
-    src_spm_processor->Encode(src_line, &src_ids);
-    trg_spm_processor->Encode(trg_line, &trg_ids);
-    maxi_batch_.emplace_back(array<vector<int>, 2>({src_ids, trg_ids}));
-  }
-  sort();
+  if(sort_ == MaxiBatchSortKey::bucket) {
+    // About num_batches cells of (source bucket, target bucket), so that most
+    // minibatches are cut from a single cell and are padded little on both sides.
+    // Within a cell, pairs are sorted by target then source length
+    size_t num_buckets = std::max<size_t>(1, std::lround(std::sqrt(num_batches)));
+    vector<uint32_t> src_bucket = length_buckets(0, num_buckets);
+    vector<uint32_t> trg_bucket = length_buckets(1, num_buckets);
+    auto key = [&](uint32_t i) {
+      uint32_t src_len = lengths_[2 * i], trg_len = lengths_[2 * i + 1];
+      return std::make_tuple(src_bucket[src_len], trg_bucket[trg_len], trg_len, src_len);
+    };
+    std::stable_sort(order_.begin() + next_,
+                     order_.end(),
+                     [&key](uint32_t lhs, uint32_t rhs) { return key(lhs) < key(rhs); });
+    return;
+  }
+  int side = sort_ == MaxiBatchSortKey::source ? 0 : 1;
+  std::stable_sort(order_.begin() + next_,
+                   order_.end(),
+                   [this, side](uint32_t lhs, uint32_t rhs) {
+                       return lengths_[2 * lhs + side] < lengths_[2 * rhs + side];
+                   });
+}
+
+// Maps each length on one side to one of num_buckets buckets holding similar
+// numbers of pairs, using the length histogram of the pairs not yet popped.
+// Pairs of the same length always share a bucket
+vector<uint32_t> MaxiBatch::length_buckets(int side, size_t num_buckets) const {
+  vector<size_t> histogram;
+  for(size_t k = next_; k < order_.size(); ++k) {
+    uint32_t length = lengths_[2 * order_[k] + side];
+    if(length >= histogram.size()) {
+      histogram.resize(length + 1);
+    }
+    ++histogram[length];
+  }
+  size_t num_pairs = order_.size() - next_;
+  vector<uint32_t> buckets(histogram.size());
+  size_t below = 0;
+  for(size_t length = 0; length < histogram.size(); ++length) {
+    buckets[length] = below * num_buckets / std::max<size_t>(num_pairs, 1);
+    below += histogram[length];
+  }
+  return buckets;
+}
+
+void MaxiBatch::fill(Corpus &corpus, const size_t &minibatch_size, size_t max_pairs) {
+  clear();
+  dropped_ = cropped_ = 0;
+  size_t capacity = max_pairs > 0 ? max_pairs
+                    : max_bytes_ > 0 ? std::numeric_limits<size_t>::max()
+                    : maxibatch_size_ * minibatch_size;
+  scratch_bytes_ = scratch_bytes();
+  // Read again to make up for skipped pairs. At least one read is made, even if
+  // the buffers left by the previous fill already take up the byte budget
+  while(order_.size() < capacity && (max_bytes_ == 0 || order_.empty() || memory_bytes() < max_bytes_)) {
+    size_t wanted = capacity - order_.size();
+    if(max_bytes_ > 0) {
+      // Estimate how many more pairs fit from the size of those read so far
+      size_t pair_bytes = order_.empty() ? 0 : arena_bytes() / order_.size();
+      size_t estimate = pair_bytes > 0 && memory_bytes() < max_bytes_
+                        ? (max_bytes_ - memory_bytes()) / pair_bytes : 0;
+      wanted = std::min(wanted, std::max(estimate, minibatch_size));
+    }
+    // Ids of corpora that hold them in memory are copied once, straight into the arena
+    size_t num_pairs;
+    if(corpus.has_views()) {
+      num_pairs = corpus.read_views(wanted, src_views_, trg_views_);
+    }
+    else {
+      num_pairs = corpus.read(wanted, src_buffer_, trg_buffer_);
+      src_views_.assign(src_buffer_.begin(), src_buffer_.begin() + num_pairs);
+      trg_views_.assign(trg_buffer_.begin(), trg_buffer_.begin() + num_pairs);
+    }
+    scratch_bytes_ = scratch_bytes();
+    for(size_t i = 0; i < num_pairs; ++i) {
+      if(apply_filter(src_views_[i], trg_views_[i])) {
+        add_pair(src_views_[i], trg_views_[i], filter_.max_length);
+      }
+    }
+    if(num_pairs < wanted) {
+      break;
+    }
+  }
+  corpus_state_ = corpus.state();
+  sort(std::max<size_t>(order_.size() / std::max<size_t>(minibatch_size, 1), 1));
+}
+
+// Returns false if the pair should be skipped. Pairs to crop are cropped by add_pair.
+// The length ratio is checked on the lengths before cropping
+bool MaxiBatch::apply_filter(IdSpan src_ids, IdSpan trg_ids) {
+  if(filter_.max_ratio > 0) {
+    size_t shorter = std::max<size_t>(std::min(src_ids.size, trg_ids.size), 1);
+    size_t longer = std::max(src_ids.size, trg_ids.size);
+    if(longer > filter_.max_ratio * shorter) {
+      ++dropped_;
+      return false;
+    }
+  }
+  if(filter_.max_length > 0 && (src_ids.size > filter_.max_length || trg_ids.size > filter_.max_length)) {
+    if(filter_.mode == MaxLengthMode::skip) {
+      ++dropped_;
+      return false;
+    }
+    ++cropped_;
+  }
+  return true;
 }
@@ -3,59 +3,204 @@
 #include <torch/torch.h>
 #include <vector>
 #include <array>
-#include <deque>
 #include <string>
-#include <fstream>
 #include <memory>
-#include <sentencepiece_processor.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
 #include "types.h"
+#include "cli_options.h"
+#include "corpus.h"
+#include "spsc_ring.h"
+#include "batch_transform.h"
 
 using namespace torch::data;
 using torch::Tensor;
 using std::string;
 using std::vector;
 using std::array;
-using sentencepiece::SentencePieceProcessor;
 
+// Limits on the sentence pairs read into a MaxiBatch
+struct LengthFilter {
+  size_t max_length = 0;  // 0 for no limit
+  MaxLengthMode mode = MaxLengthMode::crop;
+  double max_ratio = 0;   // Longer side over shorter side, 0 for no limit
+};
+
+// Sentence pairs read ahead from a corpus and sorted by length.
+// Token ids of all pairs live in one flat buffer (CSR layout), stored as 16-bit
+// until an id doesn't fit. Pairs are referred to by index, and sorting only
+// permutes the order in which these indices are popped
 class MaxiBatch {
  public:
   MaxiBatch(const size_t& maxibatch_size,
-            const MaxiBatchSortKey sort);
-  void fill(std::ifstream &src_file,
-            std::ifstream &trg_file,
-            const std::unique_ptr<SentencePieceProcessor> &src_spm_processor,
-            const std::unique_ptr<SentencePieceProcessor> &trg_spm_processor,
-            const size_t &minibatch_size);
-  bool empty() const { return maxi_batch_.empty(); }
-  array<vector<int>, 2> pop();
+            const MaxiBatchSortKey sort,
+            const LengthFilter &filter={},
+            size_t max_bytes=0);
+  // Replaces the contents with the next pairs of the corpus that pass the length filter:
+  // max_pairs pairs if given, otherwise maxibatch_size * minibatch_size pairs, or as many
+  // as fit in max_bytes if set. Memory allocated by previous fills is reused
+  void fill(Corpus &corpus, const size_t &minibatch_size, size_t max_pairs=0);
+  bool empty() const { return next_ >= order_.size(); }
+  // Number of pairs filled, including those already popped
+  size_t size() const { return order_.size(); }
+  // Bytes used by the stored pairs and, as of the last fill, by the buffers they
+  // were read into
+  size_t memory_bytes() const;
+  // Index of the next pair, without popping it
+  size_t front() const { return order_[next_]; }
+  size_t pop() { return order_[next_++]; }
+  // Number of ids on side 0 (source) or 1 (target) of pair i
+  size_t length(size_t i, int side) const { return lengths_[2 * i + side]; }
+  // Writes the ids of one side of pair i to out[0], out[stride], out[2*stride], ...
+  void copy_ids(size_t i, int side, int64_t *out, int64_t stride) const;
+  // Corpus position right after this maxi-batch was filled
+  const vector<int64_t>& corpus_state() const { return corpus_state_; }
+  // Pairs skipped and cropped by the length filter during the last fill
+  size_t dropped() const { return dropped_; }
+  size_t cropped() const { return cropped_; }
+  // Saves the pairs not yet popped
+  void save(torch::serialize::OutputArchive &archive) const;
+  void load(torch::serialize::InputArchive &archive);
+  void clear();
  private:
-  std::deque<array<vector<int>, 2>> maxi_batch_;
+  vector<uint16_t> ids16_;
+  vector<int32_t> ids32_;
+  bool wide_ids_ = false;
+  vector<uint64_t> offsets_;  // Start of the source ids of each pair, target ids follow
+  vector<uint32_t> lengths_;  // Source and target length of each pair
+  vector<uint32_t> order_;
+  size_t next_ = 0;
+  // Reused by Corpus::read and Corpus::read_views
+  vector<vector<int>> src_buffer_, trg_buffer_;
+  vector<IdSpan> src_views_, trg_views_;
+  size_t scratch_bytes_ = 0;
   const size_t maxibatch_size_;
   const MaxiBatchSortKey sort_;
+  const LengthFilter filter_;
+  const size_t max_bytes_;
+  size_t dropped_ = 0;
+  size_t cropped_ = 0;
+  vector<int64_t> corpus_state_;
+
+  size_t arena_bytes() const;
+  size_t scratch_bytes() const;
+  void add_pair(IdSpan src_ids, IdSpan trg_ids, size_t max_length=0);
+  void append_ids(IdSpan ids, size_t length);
+  bool apply_filter(IdSpan src_ids, IdSpan trg_ids);
+  void sort(size_t num_batches);
+  vector<uint32_t> length_buckets(int side, size_t num_buckets) const;
+};
 
-  void sort();
+// Pairs selected from a MaxiBatch, in the form used by PadAndStack<>::collate
+struct MaxiBatchSelection {
+  const MaxiBatch &maxi_batch;
+  const vector<size_t> &pairs;
+
+  size_t size() const { return pairs.size(); }
+  size_t length(size_t i, int side) const { return maxi_batch.length(pairs[i], side); }
+  void copy_ids(size_t i, int side, int64_t *out, int64_t stride) const {
+    maxi_batch.copy_ids(pairs[i], side, out, stride);
+  }
 };
 
-class TranslationDataset : public datasets::StatefulDataset<TranslationDataset, vector<Example<MaskedData, MaskedData>>> {
+// Reads batches from one shard of the corpus.
+// Not thread-safe, apart from its own maxi-batch prefetching: the prefetch
+// thread is the only producer and get_batch the only consumer of its ring
+// buffer, so get_batch must not be called concurrently
+class DatasetShard {
  public:
-  explicit TranslationDataset(const string& src_path,
-                              const string& trg_path,
-                              std::unique_ptr<SentencePieceProcessor> src_spm_processor,
-                              std::unique_ptr<SentencePieceProcessor> trg_spm_processor,
-                              const size_t& maxibatch_size,
-                              const MaxiBatchSortKey sort,
-                              bool reverse_src=false);
-
-  torch::optional<std::vector<Example<MaskedData, MaskedData>>> get_batch(size_t batch_size) override;
+  DatasetShard(const TrainingOptions &training_options,
+               std::unique_ptr<Corpus> corpus);
+  ~DatasetShard();
+
+  torch::optional<Example<MaskedData, MaskedData>> get_batch(size_t batch_size);
+  void reset();
+  std::optional<size_t> size() const { return corpus_->size(); }
+  // Saves the current maxi-batch and the corpus position after it.
+  // Maxi-batches prefetched beyond it are read again after loading
+  void save(torch::serialize::OutputArchive &archive) const;
+  void load(torch::serialize::InputArchive &archive);
+  // Pairs skipped and cropped by the length filter since the last call
+  size_t take_dropped() { return dropped_.exchange(0); }
+  size_t take_cropped() { return cropped_.exchange(0); }
+  // Occupancy of the maxi-batch prefetch ring since the last call
+  RingStats take_prefetch_stats() { return prefetch_queue_.take_stats(); }
+
+ private:
+  std::unique_ptr<Corpus> corpus_;
+  std::unique_ptr<MaxiBatch> maxi_batch_;
+  // Indices in maxi_batch_ of the pairs of the batch being collated
+  vector<size_t> batch_pairs_;
+  const size_t maxibatch_size_;
+  const MaxiBatchSortKey maxi_sort_;
+  const LengthFilter length_filter_;
+  const size_t maxibatch_bytes_;
+  // Cap of the adaptive maxi-batch size without a byte budget, in --maxibatch-size units
+  static constexpr size_t kMaxTargetGrowth = 16;
+  // Fraction of batch positions that --target-padding aims at, 0 = off
+  const double target_padding_;
+  // Adaptive maxi-batch size in pairs, 0 before the first adjustment
+  std::atomic<size_t> target_pairs_{0};
+  // Real and padded tokens of the batches cut from maxi_batch_
+  size_t real_tokens_ = 0;
+  size_t padded_tokens_ = 0;
+  std::atomic<size_t> dropped_{0};
+  std::atomic<size_t> cropped_{0};
+  const size_t batch_tokens_;
+  const BatchTokensSide batch_tokens_side_;
+
+  // Maxi-batches filled ahead of time by a background thread.
+  // The thread owns corpus_ while it is running
+  const size_t prefetch_;
+  SpscRing<std::unique_ptr<MaxiBatch>> prefetch_queue_;
+  // Consumed maxi-batches handed back to the producer to be refilled
+  SpscRing<std::unique_ptr<MaxiBatch>> recycled_;
+  std::thread prefetch_thread_;
+  std::exception_ptr prefetch_error_;
+
+  void next_maxi_batch(size_t batch_size);
+  std::unique_ptr<MaxiBatch> new_maxi_batch();
+  void fill(MaxiBatch &maxi_batch, size_t batch_size);
+  void adapt_maxi_batch_size(size_t batch_size);
+  void start_prefetch(size_t batch_size);
+  void stop_prefetch();
+  size_t padded_tokens(size_t src_len, size_t trg_len, size_t num_sentences) const;
+};
+
+// Yields batches that are already padded and stacked with PadAndStack<>::collate.
+// The corpus is split into shards that are read and encoded in parallel, see
+// BatchPipeline. get_batch and get_shard_batch are thread-safe
+class TranslationDataset : public datasets::StatefulDataset<TranslationDataset, Example<MaskedData, MaskedData>> {
+ public:
+  explicit TranslationDataset(const TrainingOptions &training_options,
+                              vector<std::unique_ptr<Corpus>> shard_corpora);
+
+  torch::optional<Example<MaskedData, MaskedData>> get_batch(size_t batch_size) override;
   void reset() override;
   void save(torch::serialize::OutputArchive &archive) const override;
   void load(torch::serialize::InputArchive &archive) override;
   torch::optional<size_t> size() const override;
+  size_t num_shards() const { return shards_.size(); }
+  // Next batch of one shard, std::nullopt once it is exhausted for this epoch
+  torch::optional<Example<MaskedData, MaskedData>> get_shard_batch(size_t shard, size_t batch_size);
+  // Pairs skipped and cropped by the length filter since the last call, in all shards
+  std::pair<size_t, size_t> take_filter_counts();
+  // Maxi-batch prefetch ring occupancy since the last call, summed over shards
+  RingStats take_prefetch_stats();
 
  private:
-  std::ifstream src_file_;
-  std::ifstream trg_file_;
-  std::unique_ptr<SentencePieceProcessor> src_spm_processor_;
-  std::unique_ptr<SentencePieceProcessor> trg_spm_processor_;
-  MaxiBatch maxi_batch_;
+  struct Shard {
+    Shard(const TrainingOptions &training_options, std::unique_ptr<Corpus> corpus)
+      : reader(training_options, std::move(corpus)) {}
+    std::mutex mutex;
+    DatasetShard reader;
+    bool exhausted = false;
+  };
+  vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<size_t> next_shard_{0};
+  // Set by load() so that the reset at the start of the resumed epoch
+  // keeps the loaded position
+  bool skip_next_reset_ = false;
 };
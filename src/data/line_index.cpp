@@ -0,0 +1,111 @@
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include "line_index.h"
+
+namespace {
+const char kLineIndexMagic[8] = {'M', 'T', 'N', 'E', 'S', 'S', 'L', 'I'};
+const uint64_t kLineIndexVersion = 1;
+
+// Cache file layout: LineIndexHeader, then uint64_t offsets[num_lines+1]
+struct LineIndexHeader {
+  char magic[8];
+  uint64_t version;
+  uint64_t file_size;  // Of the indexed file, to detect changes
+  int64_t mtime;
+  uint64_t num_lines;
+};
+
+// Calls add_offset with the start of every line of path, and finally with the
+// end of the last line. Returns the number of lines
+template <typename F>
+size_t scan_line_starts(const string &path, F add_offset) {
+  std::ifstream file(path, std::ios::binary);
+  vector<char> buffer(1 << 20);
+  uint64_t offset = 0;
+  size_t num_lines = 0;
+  char last_char = '\n';
+  add_offset(0);
+  while(file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+    const char *begin = buffer.data();
+    const char *end = begin + file.gcount();
+    for(const char *p = begin; (p = static_cast<const char*>(std::memchr(p, '\n', end - p))); ++p) {
+      add_offset(offset + (p - begin) + 1);
+      ++num_lines;
+    }
+    offset += file.gcount();
+    last_char = end[-1];
+  }
+  if(last_char != '\n') {
+    // Last line without a trailing newline
+    add_offset(offset);
+    ++num_lines;
+  }
+  return num_lines;
+}
+} // namespace
+
+LineIndex::LineIndex(const string &path) {
+  const uint64_t file_size = std::filesystem::file_size(path);
+  const int64_t mtime = std::filesystem::last_write_time(path).time_since_epoch().count();
+  const string index_path = path + ".idx";
+  if(map_cache(index_path, file_size, mtime)) {
+    return;
+  }
+
+  spdlog::info("Building line index of {}", path);
+  // Offsets are streamed to a temporary file, then renamed into place so that
+  // concurrent runs never see a partial index
+  const string tmp_path = index_path + ".tmp" + std::to_string(getpid());
+  std::ofstream index_file(tmp_path, std::ios::binary);
+  LineIndexHeader header{};
+  std::memcpy(header.magic, kLineIndexMagic, sizeof(kLineIndexMagic));
+  header.version = kLineIndexVersion;
+  header.file_size = file_size;
+  header.mtime = mtime;
+  if(index_file) {
+    index_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    header.num_lines = scan_line_starts(path, [&index_file](uint64_t offset) {
+      index_file.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    });
+    index_file.seekp(0, std::ios::beg);
+    index_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    index_file.close();
+    if(index_file) {
+      std::error_code error;
+      std::filesystem::rename(tmp_path, index_path, error);
+      if(!error && map_cache(index_path, file_size, mtime)) {
+        return;
+      }
+    }
+    std::filesystem::remove(tmp_path);
+  }
+
+  spdlog::warn("Could not cache line index in {}, keeping it in memory", index_path);
+  num_lines_ = scan_line_starts(path, [this](uint64_t offset) {
+    owned_offsets_.push_back(offset);
+  });
+  offsets_ = owned_offsets_.data();
+}
+
+// Maps the cached index if it exists and matches the indexed file
+bool LineIndex::map_cache(const string &index_path, uint64_t file_size, int64_t mtime) {
+  MappedFile cache;
+  if(!cache.map(index_path) || cache.size() < sizeof(LineIndexHeader)) {
+    return false;
+  }
+  const auto *header = reinterpret_cast<const LineIndexHeader*>(cache.data());
+  if(std::memcmp(header->magic, kLineIndexMagic, sizeof(kLineIndexMagic)) != 0
+     || header->version != kLineIndexVersion
+     || header->file_size != file_size
+     || header->mtime != mtime
+     || cache.size() != sizeof(LineIndexHeader) + (header->num_lines + 1) * sizeof(uint64_t)) {
+    return false;
+  }
+  num_lines_ = header->num_lines;
+  offsets_ = reinterpret_cast<const uint64_t*>(cache.data() + sizeof(LineIndexHeader));
+  cache_ = std::move(cache);
+  return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+
+using std::string;
+using std::vector;
+
+// Byte offsets of the starts of the lines of a text file.
+// The index is cached in <path>.idx and memory-mapped. It is rebuilt when the
+// text file changes, and kept in memory if the cache can't be written
+class LineIndex {
+ public:
+  explicit LineIndex(const string &path);
+  LineIndex(const LineIndex&) = delete;
+  LineIndex& operator=(const LineIndex&) = delete;
+
+  // Number of lines
+  size_t size() const { return num_lines_; }
+  // Byte offset of the start of line i. offset(size()) is the end of the last line
+  uint64_t offset(size_t line) const { return offsets_[line]; }
+
+ private:
+  MappedFile cache_;
+  vector<uint64_t> owned_offsets_;
+  const uint64_t *offsets_ = nullptr;
+  size_t num_lines_ = 0;
+
+  bool map_cache(const string &index_path, uint64_t file_size, int64_t mtime);
+};
@@ -0,0 +1,267 @@
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include "line_reader.h"
+
+namespace {
+// Decompressed bytes per chunk handed to the reading thread
+const size_t kChunkSize = 4 << 20;
+// Compressed bytes read from the file at once
+const size_t kReadBufferSize = 1 << 20;
+// Chunks decompressed ahead of the reader
+const size_t kChunksAhead = 4;
+
+[[noreturn]] void reader_error(const string &message) {
+  spdlog::error(message);
+  throw std::runtime_error(message);
+}
+
+bool ends_with(const string &path, const string &suffix) {
+  return path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+struct FileCloser {
+  void operator()(FILE *file) const {
+    if(file != stdin) {
+      std::fclose(file);
+    }
+  }
+};
+
+// Standard input and pipes, unlike files, cannot be read again from the start
+bool is_stream(const string &path) {
+  if(path == "-") {
+    return true;
+  }
+  std::error_code error;
+  auto type = std::filesystem::status(path, error).type();
+  return !error && (type == std::filesystem::file_type::fifo || type == std::filesystem::file_type::character);
+}
+
+// "-" is standard input
+std::unique_ptr<FILE, FileCloser> open_file(const string &path) {
+  std::unique_ptr<FILE, FileCloser> file(path == "-" ? stdin : std::fopen(path.c_str(), "rb"));
+  if(!file) {
+    reader_error(fmt::format("Could not open {}: {}", path, std::strerror(errno)));
+  }
+  return file;
+}
+} // namespace
+
+LineReader::LineReader(const string &path)
+    : path_(path),
+      format_(ends_with(path, ".gz") ? Format::gzip : ends_with(path, ".zst") ? Format::zstd : Format::plain),
+      stream_(is_stream(path)),
+      chunks_(kChunksAhead),
+      free_chunks_(kChunksAhead + 1) {
+#ifndef USE_ZSTD
+  if(format_ == Format::zstd) {
+    reader_error(fmt::format("Cannot read {}: MTNess was built without zstd", path));
+  }
+#endif
+  start();
+}
+
+LineReader::~LineReader() {
+  stop();
+}
+
+bool LineReader::is_compressed(const string &path) {
+  return ends_with(path, ".gz") || ends_with(path, ".zst");
+}
+
+bool LineReader::getline(string &line) {
+  line.clear();
+  bool partial = false;
+  while(true) {
+    if(chunk_pos_ >= chunk_.size()) {
+      free_chunks_.try_push(chunk_);
+      auto next = chunks_.pop();
+      if(!next) {
+        if(error_) {
+          std::rethrow_exception(error_);
+        }
+        // Last line may lack a newline
+        chunk_.clear();
+        chunk_pos_ = 0;
+        ended_ = !partial;
+        return partial;
+      }
+      chunk_ = std::move(*next);
+      chunk_pos_ = 0;
+      continue;
+    }
+    const char *begin = chunk_.data() + chunk_pos_;
+    const char *end = chunk_.data() + chunk_.size();
+    const char *newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+    if(newline) {
+      line.append(begin, newline);
+      chunk_pos_ += newline - begin + 1;
+      return true;
+    }
+    // Line continues in the next chunk
+    line.append(begin, end);
+    chunk_pos_ = chunk_.size();
+    partial = true;
+  }
+}
+
+void LineReader::reopen() {
+  if(stream_ && !ended_) {
+    return;
+  }
+  stop();
+  chunks_.reopen();
+  chunk_.clear();
+  chunk_pos_ = 0;
+  start();
+}
+
+void LineReader::start() {
+  error_ = nullptr;
+  ended_ = false;
+  thread_ = std::thread([this]() {
+    try {
+      switch(format_) {
+        case Format::gzip:
+          read_gzip();
+          break;
+        case Format::zstd:
+          read_zstd();
+          break;
+        default:
+          read_plain();
+      }
+    }
+    catch(...) {
+      error_ = std::current_exception();
+    }
+    chunks_.close();
+  });
+}
+
+// Makes the reading thread stop at its next chunk
+void LineReader::stop() {
+  if(thread_.joinable()) {
+    chunks_.close();
+    thread_.join();
+  }
+}
+
+vector<char> LineReader::new_chunk() {
+  auto chunk = free_chunks_.try_pop();
+  vector<char> result = chunk ? std::move(*chunk) : vector<char>();
+  result.resize(kChunkSize);
+  return result;
+}
+
+// Hands a chunk to the reader. Returns false if the reader stopped
+bool LineReader::emit(vector<char> &chunk) {
+  return chunk.empty() || chunks_.push(std::move(chunk));
+}
+
+void LineReader::read_plain() {
+  auto file = open_file(path_);
+  while(true) {
+    vector<char> chunk = new_chunk();
+    size_t size = std::fread(chunk.data(), 1, chunk.size(), file.get());
+    if(std::ferror(file.get())) {
+      reader_error(fmt::format("Error reading {}", path_));
+    }
+    chunk.resize(size);
+    if(size == 0 || !emit(chunk)) {
+      return;
+    }
+  }
+}
+
+void LineReader::read_gzip() {
+  gzFile file = gzopen(path_.c_str(), "rb");
+  if(!file) {
+    reader_error(fmt::format("Could not open {}: {}", path_, std::strerror(errno)));
+  }
+  gzbuffer(file, kReadBufferSize);
+  while(true) {
+    vector<char> chunk = new_chunk();
+    int size = gzread(file, chunk.data(), chunk.size());
+    if(size < 0) {
+      int code;
+      string message = gzerror(file, &code);
+      gzclose(file);
+      reader_error(fmt::format("Error decompressing {}: {}", path_, message));
+    }
+    if(size == 0) {
+      // A stream cut short ends in an error rather than a clean end of file
+      int code;
+      string message = gzerror(file, &code);
+      gzclose(file);
+      if(code != Z_OK) {
+        reader_error(fmt::format("Error decompressing {}: {}", path_, message));
+      }
+      return;
+    }
+    chunk.resize(size);
+    if(!emit(chunk)) {
+      break;
+    }
+  }
+  gzclose(file);
+}
+
+void LineReader::read_zstd() {
+#ifdef USE_ZSTD
+  auto file = open_file(path_);
+  std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+  vector<char> input_buffer(std::max(kReadBufferSize, ZSTD_DStreamInSize()));
+  vector<char> chunk = new_chunk();
+  size_t filled = 0;
+  size_t result = 0;
+  bool input_ended = false;
+  while(!input_ended) {
+    size_t read = std::fread(input_buffer.data(), 1, input_buffer.size(), file.get());
+    if(std::ferror(file.get())) {
+      reader_error(fmt::format("Error reading {}", path_));
+    }
+    input_ended = read == 0;
+    // At the end of the file, empty input flushes what zstd still holds of an
+    // unfinished frame
+    if(input_ended && result == 0) {
+      break;
+    }
+    ZSTD_inBuffer input{input_buffer.data(), read, 0};
+    while(true) {
+      ZSTD_outBuffer output{chunk.data() + filled, chunk.size() - filled, 0};
+      result = ZSTD_decompressStream(context.get(), &output, &input);
+      if(ZSTD_isError(result)) {
+        reader_error(fmt::format("Error decompressing {}: {}", path_, ZSTD_getErrorName(result)));
+      }
+      filled += output.pos;
+      bool output_full = output.pos == output.size;
+      if(filled == chunk.size()) {
+        if(!emit(chunk)) {
+          return;
+        }
+        chunk = new_chunk();
+        filled = 0;
+      }
+      // A full output buffer may leave more output buffered in zstd
+      if(input.pos == input.size && !output_full) {
+        break;
+      }
+    }
+  }
+  if(result != 0) {
+    reader_error(fmt::format("Error decompressing {}: file is truncated", path_));
+  }
+  chunk.resize(filled);
+  emit(chunk);
+#endif
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spsc_ring.h"
+
+using std::string;
+using std::vector;
+
+// Reads a text file line by line. Files ending in .gz or .zst are decompressed
+// on the fly, and "-" reads standard input. A background thread reads and
+// decompresses the file in large chunks, so that decompression overlaps with
+// whatever the caller does with the lines
+class LineReader {
+ public:
+  explicit LineReader(const string &path);
+  ~LineReader();
+  LineReader(const LineReader&) = delete;
+  LineReader& operator=(const LineReader&) = delete;
+
+  // Reads the next line without its newline. Returns false at the end of the file
+  bool getline(string &line);
+  // Starts again from the beginning of the file. Standard input and named pipes
+  // can't be read again, so until they end they carry on from where they are,
+  // keeping the chunks read ahead. Once ended, they are opened again
+  void reopen();
+  const string &path() const { return path_; }
+
+  // Whether the path names a compressed file, which can only be read front to back
+  static bool is_compressed(const string &path);
+
+ private:
+  enum class Format { plain, gzip, zstd };
+
+  const string path_;
+  const Format format_;
+  // Standard input or a pipe, which can only be read once
+  const bool stream_;
+  // getline has reached the end of the input
+  bool ended_ = false;
+  // Decompressed chunks, and emptied chunks handed back for reuse
+  SpscRing<vector<char>> chunks_;
+  SpscRing<vector<char>> free_chunks_;
+  vector<char> chunk_;
+  size_t chunk_pos_ = 0;
+  std::thread thread_;
+  std::exception_ptr error_;
+
+  void start();
+  void stop();
+  void read_plain();
+  void read_gzip();
+  void read_zstd();
+  vector<char> new_chunk();
+  bool emit(vector<char> &chunk);
+};
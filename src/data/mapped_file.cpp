@@ -0,0 +1,66 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <utility>
+#include "mapped_file.h"
+
+MappedFile::~MappedFile() {
+  unmap();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+MappedFile& MappedFile::operator=(MappedFile &&other) noexcept {
+  if(this != &other) {
+    unmap();
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+  }
+  return *this;
+}
+
+bool MappedFile::map(const string &path) {
+  unmap();
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  if(fstat(fd, &file_stat) != 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return false;
+  }
+  size_t size = file_stat.st_size;
+  if(size > 0) {
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if(mapping == MAP_FAILED) {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return false;
+    }
+    data_ = static_cast<const char*>(mapping);
+    size_ = size;
+  }
+  close(fd);
+  return true;
+}
+
+void MappedFile::unmap() {
+  if(data_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
+
+void MappedFile::advise_sequential() const {
+  if(data_) {
+    madvise(const_cast<char*>(data_), size_, MADV_SEQUENTIAL);
+  }
+}
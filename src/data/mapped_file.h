@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+using std::string;
+
+// Read-only shared memory mapping of a whole file. The file descriptor is
+// closed once the file is mapped, which leaves the mapping valid. Empty files
+// map to size() 0 and a null data()
+class MappedFile {
+ public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(MappedFile &&other) noexcept;
+  MappedFile& operator=(MappedFile &&other) noexcept;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Maps path in place of the current mapping. Returns false with errno set if
+  // the file cannot be opened, stat'ed or mapped
+  bool map(const string &path);
+  void unmap();
+  // Tells the kernel that the file will be read front to back
+  void advise_sequential() const;
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
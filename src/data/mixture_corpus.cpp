@@ -0,0 +1,158 @@
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include "mixture_corpus.h"
+
+MixtureCorpus::MixtureCorpus(vector<std::unique_ptr<Corpus>> corpora, const vector<double> &weights,
+                             const CorpusOptions &options)
+    : corpora_(std::move(corpora)),
+      weights_(weights),
+      // Different shards draw differently
+      seed_(options.seed + options.shard),
+      completed_(corpora_.size(), false),
+      src_buffers_(corpora_.size()),
+      trg_buffers_(corpora_.size()) {
+  if(weights_.empty()) {
+    weights_.assign(corpora_.size(), 1.0);
+  }
+  if(weights_.size() != corpora_.size()) {
+    string message = fmt::format("Got {} data weights for {} corpora", weights_.size(), corpora_.size());
+    spdlog::error(message);
+    throw std::invalid_argument(message);
+  }
+  if(std::none_of(weights_.begin(), weights_.end(), [](double weight) { return weight > 0; })) {
+    string message = "At least one corpus needs a positive data weight";
+    spdlog::error(message);
+    throw std::invalid_argument(message);
+  }
+  for(size_t i = 0; i < corpora_.size(); ++i) {
+    if(weights_[i] <= 0) {
+      // Never drawn, so it doesn't hold up the end of the epoch
+      completed_[i] = true;
+      ++num_completed_;
+    }
+  }
+}
+
+// Number of pairs to take from each corpus for the next num_pairs pairs
+vector<size_t> MixtureCorpus::draw(size_t num_pairs) {
+  std::seed_seq seed{seed_, static_cast<uint64_t>(epoch_), static_cast<uint64_t>(draws_++)};
+  std::mt19937_64 generator(seed);
+  std::discrete_distribution<size_t> distribution(weights_.begin(), weights_.end());
+  vector<size_t> counts(corpora_.size(), 0);
+  for(size_t i = 0; i < num_pairs; ++i) {
+    ++counts[distribution(generator)];
+  }
+  return counts;
+}
+
+// Reads up to max_pairs pairs from one corpus, resetting it whenever it runs out
+size_t MixtureCorpus::read_from(size_t corpus, size_t max_pairs,
+                                vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) {
+  size_t num_pairs = corpora_[corpus]->read(max_pairs, src_ids, trg_ids);
+  if(num_pairs < max_pairs) {
+    corpora_[corpus]->reset();
+    if(!completed_[corpus]) {
+      completed_[corpus] = true;
+      ++num_completed_;
+    }
+    if(num_completed_ == corpora_.size()) {
+      // End of epoch
+      return num_pairs;
+    }
+    if(num_pairs == 0) {
+      // Nothing more even after the reset: leave the corpus out from now on
+      size_t more = corpora_[corpus]->read(max_pairs, src_ids, trg_ids);
+      if(more == 0) {
+        spdlog::warn("Training corpus {} of the mixture is empty", corpus);
+        weights_[corpus] = 0;
+      }
+      return more;
+    }
+  }
+  return num_pairs;
+}
+
+bool MixtureCorpus::next(vector<int> &src_ids, vector<int> &trg_ids) {
+  vector<vector<int>> src(1), trg(1);
+  if(read(1, src, trg) == 0) {
+    return false;
+  }
+  src_ids.swap(src[0]);
+  trg_ids.swap(trg[0]);
+  return true;
+}
+
+// Draws how many pairs each corpus contributes, then reads them in bulk so
+// that every corpus still encodes in parallel
+size_t MixtureCorpus::read(size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) {
+  if(src_ids.size() < max_pairs) {
+    src_ids.resize(max_pairs);
+    trg_ids.resize(max_pairs);
+  }
+  size_t num_pairs = 0;
+  while(num_pairs < max_pairs && num_completed_ < corpora_.size()) {
+    if(std::all_of(weights_.begin(), weights_.end(), [](double weight) { return weight <= 0; })) {
+      break;
+    }
+    vector<size_t> counts = draw(max_pairs - num_pairs);
+    for(size_t corpus = 0; corpus < corpora_.size() && num_completed_ < corpora_.size(); ++corpus) {
+      size_t wanted = counts[corpus];
+      while(wanted > 0 && num_completed_ < corpora_.size() && weights_[corpus] > 0) {
+        size_t read = read_from(corpus, wanted, src_buffers_[corpus], trg_buffers_[corpus]);
+        for(size_t i = 0; i < read; ++i) {
+          src_ids[num_pairs].swap(src_buffers_[corpus][i]);
+          trg_ids[num_pairs].swap(trg_buffers_[corpus][i]);
+          ++num_pairs;
+        }
+        wanted -= read;
+      }
+    }
+  }
+  return num_pairs;
+}
+
+// Corpora that ran out were already reset and continue where they are
+void MixtureCorpus::reset() {
+  ++epoch_;
+  draws_ = 0;
+  num_completed_ = 0;
+  for(size_t i = 0; i < corpora_.size(); ++i) {
+    completed_[i] = weights_[i] <= 0;
+    num_completed_ += completed_[i];
+  }
+}
+
+// Epoch, draws, then for each corpus: completed, length of its state, its state
+vector<int64_t> MixtureCorpus::state() const {
+  vector<int64_t> state = {static_cast<int64_t>(epoch_), static_cast<int64_t>(draws_)};
+  for(size_t i = 0; i < corpora_.size(); ++i) {
+    vector<int64_t> corpus_state = corpora_[i]->state();
+    state.push_back(completed_[i]);
+    state.push_back(corpus_state.size());
+    state.insert(state.end(), corpus_state.begin(), corpus_state.end());
+  }
+  return state;
+}
+
+void MixtureCorpus::restore(const vector<int64_t> &state) {
+  if(state.size() < 2) {
+    return;
+  }
+  epoch_ = state[0];
+  draws_ = state[1];
+  num_completed_ = 0;
+  size_t position = 2;
+  for(size_t i = 0; i < corpora_.size() && position + 2 <= state.size(); ++i) {
+    completed_[i] = state[position] != 0;
+    num_completed_ += completed_[i];
+    size_t length = state[position + 1];
+    position += 2;
+    if(position + length > state.size()) {
+      return;
+    }
+    corpora_[i]->restore(vector<int64_t>(state.begin() + position, state.begin() + position + length));
+    position += length;
+  }
+}
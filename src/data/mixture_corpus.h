@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "corpus.h"
+
+using std::vector;
+
+// Draws sentence pairs from several corpora at random, in proportion to their
+// weights. Each corpus keeps its own read position: when one runs out it is
+// reset on its own and drawn from again, so corpora with high weights are
+// upsampled. The epoch ends once every corpus has been read through at least once
+class MixtureCorpus : public Corpus {
+ public:
+  MixtureCorpus(vector<std::unique_ptr<Corpus>> corpora, const vector<double> &weights,
+                const CorpusOptions &options={});
+
+  bool next(vector<int> &src_ids, vector<int> &trg_ids) override;
+  size_t read(size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) override;
+  void reset() override;
+  vector<int64_t> state() const override;
+  void restore(const vector<int64_t> &state) override;
+
+ private:
+  vector<std::unique_ptr<Corpus>> corpora_;
+  vector<double> weights_;
+  const uint64_t seed_;
+  size_t epoch_ = 0;
+  size_t draws_ = 0;           // Calls to draw() this epoch, to reseed deterministically
+  vector<bool> completed_;     // Read through this epoch
+  size_t num_completed_ = 0;
+  // Per corpus read buffers, reused
+  vector<vector<vector<int>>> src_buffers_, trg_buffers_;
+
+  vector<size_t> draw(size_t num_pairs);
+  size_t read_from(size_t corpus, size_t max_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids);
+};
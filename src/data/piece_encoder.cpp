@@ -0,0 +1,142 @@
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <sstream>
+#include "piece_encoder.h"
+
+namespace {
+// Tabs, carriage returns and other control characters may be normalized into
+// whitespace or removed, so lines with them are not split at spaces only
+bool has_control_characters(const string &line) {
+  return std::any_of(line.begin(), line.end(), [](char c) { return static_cast<unsigned char>(c) < 0x20; });
+}
+} // namespace
+
+PieceEncoder::PieceEncoder(std::unique_ptr<SentencePieceProcessor> spm_processor, size_t cache_size)
+    : spm_processor_(std::move(spm_processor)),
+      shard_capacity_((cache_size + kNumShards - 1) / kNumShards),
+      caching_(cache_size > 0) {
+  // Extra options set by load_vocab
+  spm_processor_->Encode("", &suffix_);
+}
+
+void PieceEncoder::set_extra_options(const string &extra_options) {
+  spm_processor_->SetEncodeExtraOptions(extra_options);
+  spm_processor_->Encode("", &suffix_);
+  // Only markers appended to the whole line can be added after the cached words
+  bool eos_only = true;
+  std::istringstream options(extra_options);
+  for(string option; std::getline(options, option, ':');) {
+    eos_only = eos_only && option == "eos";
+  }
+  caching_ = shard_capacity_ > 0 && eos_only;
+  for(auto &shard : shards_) {
+    shard.index.clear();
+    shard.entries.clear();
+    shard.hand = 0;
+  }
+}
+
+void PieceEncoder::encode(const string &line, vector<int> &ids) const {
+  if(!caching_.load(std::memory_order_relaxed) || has_control_characters(line)) {
+    spm_processor_->Encode(line, &ids);
+    return;
+  }
+  if(verified_.load(std::memory_order_relaxed) < kVerifyLines) {
+    vector<int> expected;
+    spm_processor_->Encode(line, &expected);
+    encode_words(line, ids);
+    if(ids != expected) {
+      if(caching_.exchange(false)) {
+        spdlog::warn("SentencePiece segments \"{}\" differently word by word. Words are no longer cached", line);
+      }
+      ids.swap(expected);
+    }
+    verified_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  encode_words(line, ids);
+}
+
+PieceCacheStats PieceEncoder::take_stats() {
+  PieceCacheStats stats;
+  stats.lookups = lookups_.exchange(0, std::memory_order_relaxed);
+  stats.hits = hits_.exchange(0, std::memory_order_relaxed);
+  return stats;
+}
+
+void PieceEncoder::encode_words(const string &line, vector<int> &ids) const {
+  ids.clear();
+  uint64_t lookups = 0, hits = 0;
+  for(size_t begin = 0; begin < line.size();) {
+    size_t end = std::min(line.find(' ', begin), line.size());
+    if(end > begin) {
+      std::string_view word(line.data() + begin, end - begin);
+      if(word.size() > kMaxWordBytes) {
+        encode_word(word, ids);
+      }
+      else {
+        ++lookups;
+        hits += append_word(word, ids);
+      }
+    }
+    begin = end + 1;
+  }
+  ids.insert(ids.end(), suffix_.begin(), suffix_.end());
+  lookups_.fetch_add(lookups, std::memory_order_relaxed);
+  hits_.fetch_add(hits, std::memory_order_relaxed);
+}
+
+// Appends the ids of word from the cache, or encodes and caches it.
+// Returns whether it was cached
+bool PieceEncoder::append_word(std::string_view word, vector<int> &ids) const {
+  Shard &shard = shards_[std::hash<std::string_view>()(word) % kNumShards];
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(word);
+    if(found != shard.index.end()) {
+      Entry &entry = shard.entries[found->second];
+      entry.referenced = true;
+      ids.insert(ids.end(), entry.ids.begin(), entry.ids.end());
+      return true;
+    }
+  }
+  // Encoded without holding the lock
+  size_t start = ids.size();
+  encode_word(word, ids);
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if(shard.index.count(word) > 0) {
+    // Cached by another thread meanwhile
+    return false;
+  }
+  size_t slot = shard.entries.size();
+  if(slot < shard_capacity_) {
+    shard.entries.emplace_back();
+  }
+  else {
+    // CLOCK: evict the next entry that wasn't used since the hand last passed it
+    while(shard.entries[shard.hand].referenced) {
+      shard.entries[shard.hand].referenced = false;
+      shard.hand = (shard.hand + 1) % shard.entries.size();
+    }
+    slot = shard.hand;
+    shard.hand = (shard.hand + 1) % shard.entries.size();
+    shard.index.erase(shard.entries[slot].word);
+  }
+  Entry &entry = shard.entries[slot];
+  entry.word.assign(word);
+  entry.ids.assign(ids.begin() + start, ids.end());
+  entry.referenced = false;
+  shard.index.emplace(entry.word, slot);
+  return false;
+}
+
+// Appends the pieces of a single word, without the markers of the extra options
+void PieceEncoder::encode_word(std::string_view word, vector<int> &ids) const {
+  thread_local string word_buffer;
+  thread_local vector<int> word_ids;
+  word_buffer.assign(word);
+  spm_processor_->Encode(word_buffer, &word_ids);
+  size_t num_pieces = word_ids.size() >= suffix_.size() ? word_ids.size() - suffix_.size() : 0;
+  ids.insert(ids.end(), word_ids.begin(), word_ids.begin() + num_pieces);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sentencepiece_processor.h>
+
+using std::string;
+using std::vector;
+using sentencepiece::SentencePieceProcessor;
+
+// Lookups and hits of a PieceEncoder cache
+struct PieceCacheStats {
+  uint64_t lookups = 0;
+  uint64_t hits = 0;
+
+  double hit_rate() const { return lookups > 0 ? static_cast<double>(hits) / lookups : 0.0; }
+};
+
+// SentencePiece model with a cache of the segmentations of single words.
+// SentencePiece never joins pieces across whitespace, so a line encodes to the
+// pieces of its space-separated words one after another. Natural text is
+// Zipfian, so most words are found in the cache and only rare ones are encoded.
+// Lines are encoded whole instead when this doesn't hold: with extra options
+// other than eos (e.g. reverse:eos), for lines with tabs or control characters,
+// and for good if the first lines encode differently word by word (e.g. a model
+// trained without the dummy prefix).
+// The cache is split into shards, each with its own lock and CLOCK eviction,
+// so encode() can be called from several threads
+class PieceEncoder {
+ public:
+  // Caches up to cache_size words, 0 to always encode whole lines
+  PieceEncoder(std::unique_ptr<SentencePieceProcessor> spm_processor, size_t cache_size);
+  PieceEncoder(const PieceEncoder&) = delete;
+  PieceEncoder& operator=(const PieceEncoder&) = delete;
+
+  // Sets SentencePieceProcessor::SetEncodeExtraOptions. Not while encoding
+  void set_extra_options(const string &extra_options);
+  void encode(const string &line, vector<int> &ids) const;
+  const SentencePieceProcessor &processor() const { return *spm_processor_; }
+  bool caching() const { return caching_.load(std::memory_order_relaxed); }
+  // Counts since the last call. Safe to call from any thread
+  PieceCacheStats take_stats();
+
+ private:
+  struct Entry {
+    string word;
+    vector<int> ids;
+    bool referenced;
+  };
+  struct Shard {
+    std::mutex mutex;
+    // Keys point into the words of entries, which a deque never moves
+    std::unordered_map<std::string_view, size_t> index;
+    std::deque<Entry> entries;
+    size_t hand = 0;
+  };
+  static constexpr size_t kNumShards = 64;
+  // Longer words (e.g. URLs) are rarely repeated and are not cached
+  static constexpr size_t kMaxWordBytes = 64;
+  // Lines encoded both ways before trusting the cache
+  static constexpr uint64_t kVerifyLines = 1000;
+
+  std::unique_ptr<SentencePieceProcessor> spm_processor_;
+  const size_t shard_capacity_;
+  // Ids the extra options add to every line, e.g. eos
+  vector<int> suffix_;
+  // Mutable so that encode() stays const like SentencePieceProcessor::Encode
+  mutable std::atomic<bool> caching_;
+  mutable std::atomic<uint64_t> verified_{0};
+  mutable std::array<Shard, kNumShards> shards_;
+  mutable std::atomic<uint64_t> lookups_{0};
+  mutable std::atomic<uint64_t> hits_{0};
+
+  void encode_words(const string &line, vector<int> &ids) const;
+  bool append_word(std::string_view word, vector<int> &ids) const;
+  void encode_word(std::string_view word, vector<int> &ids) const;
+};
@@ -0,0 +1,108 @@
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include "pipeline.h"
+
+BatchPipeline::BatchPipeline(TranslationDataset &dataset, const TrainingOptions &training_options)
+    : dataset_(dataset),
+      batch_size_(training_options.batch_size) {
+  // Default to one collate thread per shard, and never more than that
+  size_t num_collators = training_options.collate_threads > 0 ? training_options.collate_threads
+                                                              : dataset_.num_shards();
+  num_collators = std::max<size_t>(1, std::min(num_collators, dataset_.num_shards()));
+  for(size_t i = 0; i < num_collators; ++i) {
+    collators_.emplace_back(std::make_unique<Collator>(training_options.prefetch_batches));
+  }
+  for(size_t shard = 0; shard < dataset_.num_shards(); ++shard) {
+    collators_[shard % num_collators]->shards.push_back(shard);
+  }
+}
+
+BatchPipeline::~BatchPipeline() {
+  stop();
+}
+
+void BatchPipeline::start_epoch() {
+  stop();
+  dataset_.reset();
+  for(auto &collator : collators_) {
+    collator->batches.reopen();
+    collator->error = nullptr;
+    collator->done = false;
+    collator->thread = std::thread([this, &collator = *collator]() { collate(collator); });
+  }
+  next_collator_ = 0;
+  active_collators_ = collators_.size();
+}
+
+// Takes batches from the collate threads in turn, skipping those that are done
+torch::optional<Example<MaskedData, MaskedData>> BatchPipeline::next() {
+  while(active_collators_ > 0) {
+    Collator &collator = *collators_[next_collator_];
+    next_collator_ = (next_collator_ + 1) % collators_.size();
+    if(collator.done) {
+      continue;
+    }
+    auto batch = collator.batches.pop();
+    if(batch) {
+      return std::move(*batch);
+    }
+    collator.done = true;
+    --active_collators_;
+    if(collator.error) {
+      // Report failures of the data stages on the training thread
+      std::rethrow_exception(collator.error);
+    }
+  }
+  // End of epoch
+  return torch::optional<Example<MaskedData, MaskedData>>();
+}
+
+// Cuts batches from the collator's shards in turn until all of them are exhausted
+void BatchPipeline::collate(Collator &collator) {
+  try {
+    vector<size_t> shards = collator.shards;
+    size_t next = 0;
+    while(!shards.empty()) {
+      next %= shards.size();
+      auto batch = dataset_.get_shard_batch(shards[next], batch_size_);
+      if(!batch) {
+        shards.erase(shards.begin() + next);
+        continue;
+      }
+      if(!collator.batches.push(std::move(*batch))) {
+        // Stopped
+        break;
+      }
+      ++next;
+    }
+  }
+  catch(...) {
+    collator.error = std::current_exception();
+  }
+  collator.batches.close();
+}
+
+void BatchPipeline::stop() {
+  for(auto &collator : collators_) {
+    collator->batches.close();
+  }
+  for(auto &collator : collators_) {
+    if(collator->thread.joinable()) {
+      collator->thread.join();
+    }
+  }
+}
+
+string BatchPipeline::take_stats() {
+  RingStats maxi_batches = dataset_.take_prefetch_stats();
+  RingStats batches;
+  for(auto &collator : collators_) {
+    batches += collator->batches.take_stats();
+  }
+  return fmt::format("Maxi-batches queued: {:.1f}/{}, collate waited {}x, fill blocked {}x"
+                     " ||| Batches queued: {:.1f}/{}, trainer waited {}x, collate blocked {}x",
+                     maxi_batches.occupancy(), maxi_batches.capacity,
+                     maxi_batches.empty_waits, maxi_batches.full_waits,
+                     batches.occupancy(), batches.capacity,
+                     batches.empty_waits, batches.full_waits);
+}
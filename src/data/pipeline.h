@@ -0,0 +1,59 @@
+#pragma once
+
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cli_options.h"
+#include "dataset.h"
+#include "spsc_ring.h"
+
+using std::string;
+using std::vector;
+
+// Feeds training batches from a TranslationDataset through explicit stages:
+//   fill:    one thread per shard reads, encodes and sorts maxi-batches
+//            (DatasetShard prefetching, --prefetch-maxibatches deep)
+//   collate: collate_threads threads cut minibatches out of the maxi-batches and
+//            stack them into tensors, each serving a fixed subset of the shards
+//            (--prefetch-batches deep)
+//   train:   the caller takes batches with next()
+// Stages are connected by SpscRings. Each shard is served by a single collate
+// thread, so the shard lock, which guards it against checkpointing, is never
+// contended on the way to the trainer. Batches come out in a fixed round-robin
+// order over the collate threads, which keeps runs reproducible
+class BatchPipeline {
+ public:
+  BatchPipeline(TranslationDataset &dataset, const TrainingOptions &training_options);
+  ~BatchPipeline();
+  BatchPipeline(const BatchPipeline&) = delete;
+  BatchPipeline& operator=(const BatchPipeline&) = delete;
+
+  // Resets the dataset for the next epoch and starts the collate threads
+  void start_epoch();
+  // Next batch of the epoch, or std::nullopt at the end of the epoch
+  torch::optional<Example<MaskedData, MaskedData>> next();
+  // Queue occupancy and waits of each stage since the last call. A stage whose
+  // input queue is mostly empty is starved by the stage before it
+  string take_stats();
+
+ private:
+  struct Collator {
+    explicit Collator(size_t capacity) : batches(capacity) {}
+    SpscRing<Example<MaskedData, MaskedData>> batches;
+    vector<size_t> shards;
+    std::thread thread;
+    std::exception_ptr error;
+    bool done = false;
+  };
+
+  TranslationDataset &dataset_;
+  const size_t batch_size_;
+  vector<std::unique_ptr<Collator>> collators_;
+  size_t next_collator_ = 0;
+  size_t active_collators_ = 0;
+
+  void collate(Collator &collator);
+  void stop();
+};
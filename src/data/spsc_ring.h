@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Occupancy and waiting counters of a SpscRing
+struct RingStats {
+  size_t capacity = 0;
+  uint64_t pops = 0;
+  uint64_t occupancy_sum = 0;  // Elements queued before each pop, summed
+  uint64_t empty_waits = 0;    // Pops that had to wait for the producer
+  uint64_t full_waits = 0;     // Pushes that had to wait for the consumer
+
+  double occupancy() const { return pops > 0 ? static_cast<double>(occupancy_sum) / pops : 0.0; }
+  RingStats &operator+=(const RingStats &other) {
+    capacity += other.capacity;
+    pops += other.pops;
+    occupancy_sum += other.occupancy_sum;
+    empty_waits += other.empty_waits;
+    full_waits += other.full_waits;
+    return *this;
+  }
+};
+
+// Bounded lock-free ring buffer between exactly one producer thread and one
+// consumer thread at a time. push() and pop() spin briefly while the ring is
+// full or empty, then block on a condition variable. The mutex is only taken
+// to block, and by the other side to wake a blocked thread.
+// close() makes push() fail, while pop() returns the remaining elements
+// followed by std::nullopt
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity)
+      : capacity_(capacity > 0 ? capacity : 1), slots_(capacity_ + 1) {}
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  // Moves item into the ring unless it is full
+  bool try_push(T &item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t next = (tail + 1) % slots_.size();
+    if(next == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    slots_[tail] = std::move(item);
+    tail_.store(next, std::memory_order_release);
+    wake(consumer_waiting_, not_empty_);
+    return true;
+  }
+
+  std::optional<T> try_pop() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if(head == tail_.load(std::memory_order_acquire)) {
+      return std::nullopt;
+    }
+    T item = std::move(*slots_[head]);
+    slots_[head].reset();
+    head_.store((head + 1) % slots_.size(), std::memory_order_release);
+    wake(producer_waiting_, not_full_);
+    return item;
+  }
+
+  // Waits while the ring is full. Returns false if the ring was closed
+  bool push(T item) {
+    for(size_t spins = 0; ; ++spins) {
+      if(closed_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      if(try_push(item)) {
+        return true;
+      }
+      if(spins == 0) {
+        full_waits_.fetch_add(1, std::memory_order_relaxed);
+      }
+      if(spins < kSpins) {
+        std::this_thread::yield();
+      }
+      else {
+        block(producer_waiting_, not_full_, [this]() { return closed() || !full(); });
+      }
+    }
+  }
+
+  // Waits while the ring is empty. Returns std::nullopt once closed and drained
+  std::optional<T> pop() {
+    occupancy_sum_.fetch_add(size(), std::memory_order_relaxed);
+    pops_.fetch_add(1, std::memory_order_relaxed);
+    for(size_t spins = 0; ; ++spins) {
+      if(auto item = try_pop()) {
+        return item;
+      }
+      if(closed_.load(std::memory_order_acquire)) {
+        // Elements pushed before closing
+        return try_pop();
+      }
+      if(spins == 0) {
+        empty_waits_.fetch_add(1, std::memory_order_relaxed);
+      }
+      if(spins < kSpins) {
+        std::this_thread::yield();
+      }
+      else {
+        block(consumer_waiting_, not_empty_, [this]() { return closed() || size() > 0; });
+      }
+    }
+  }
+
+  void close() {
+    closed_.store(true, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(mutex_);
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  // Drops the remaining elements and opens the ring again.
+  // Only while no thread is pushing or popping
+  void reopen() {
+    while(try_pop()) {}
+    closed_.store(false, std::memory_order_release);
+  }
+
+  size_t size() const {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    return (tail + slots_.size() - head) % slots_.size();
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // Counters since the last call. Safe to call from any thread
+  RingStats take_stats() {
+    RingStats stats;
+    stats.capacity = capacity_;
+    stats.pops = pops_.exchange(0, std::memory_order_relaxed);
+    stats.occupancy_sum = occupancy_sum_.exchange(0, std::memory_order_relaxed);
+    stats.empty_waits = empty_waits_.exchange(0, std::memory_order_relaxed);
+    stats.full_waits = full_waits_.exchange(0, std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  const size_t capacity_;
+  // One slot stays free to tell a full ring from an empty one.
+  // Popped slots are emptied, so T needs no default constructor
+  std::vector<std::optional<T>> slots_;
+  // Producer and consumer indices on separate cache lines
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) std::atomic<bool> closed_{false};
+  std::atomic<uint64_t> pops_{0};
+  std::atomic<uint64_t> occupancy_sum_{0};
+  std::atomic<uint64_t> empty_waits_{0};
+  std::atomic<uint64_t> full_waits_{0};
+  // Yields before blocking, enough to ride out short stalls of the other side
+  static constexpr size_t kSpins = 64;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::atomic<bool> consumer_waiting_{false};
+  std::atomic<bool> producer_waiting_{false};
+
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+  bool full() const { return size() == capacity_; }
+
+  // Blocks until ready() holds. The flag tells the other side to wake us
+  template <typename Ready>
+  void block(std::atomic<bool> &waiting, std::condition_variable &condition, Ready ready) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    waiting.store(true, std::memory_order_relaxed);
+    // Pairs with the fence in wake(): either the other side sees the flag,
+    // or ready() sees its update
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    condition.wait(lock, ready);
+    waiting.store(false, std::memory_order_relaxed);
+  }
+
+  // Wakes the other side if it is blocked. Taking the mutex keeps the
+  // notification from slipping in between its ready() check and its wait
+  void wake(std::atomic<bool> &waiting, std::condition_variable &condition) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(waiting.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      condition.notify_one();
+    }
+  }
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t num_threads) {
+    for(size_t i = 0; i < num_threads; ++i) {
+      workers_.emplace_back([this]() { work(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    task_available_.notify_all();
+    for(auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t size() const { return workers_.size(); }
+
+  // Runs f(i) for every i in [0, n), split into one contiguous chunk per thread.
+  // Blocks until all chunks are done and rethrows the first exception raised by f
+  template <typename F>
+  void parallel_for(size_t n, F f) {
+    size_t num_chunks = std::min(n, workers_.size());
+    if(num_chunks <= 1) {
+      for(size_t i = 0; i < n; ++i) {
+        f(i);
+      }
+      return;
+    }
+    std::vector<std::future<void>> done;
+    done.reserve(num_chunks);
+    for(size_t chunk = 0; chunk < num_chunks; ++chunk) {
+      size_t begin = n * chunk / num_chunks;
+      size_t end = n * (chunk + 1) / num_chunks;
+      auto task = std::make_shared<std::packaged_task<void()>>([&f, begin, end]() {
+        for(size_t i = begin; i < end; ++i) {
+          f(i);
+        }
+      });
+      done.emplace_back(task->get_future());
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.emplace_back([task]() { (*task)(); });
+      }
+      task_available_.notify_one();
+    }
+    // Wait for every chunk before rethrowing, the others still reference f
+    for(auto &chunk_done : done) {
+      chunk_done.wait();
+    }
+    for(auto &chunk_done : done) {
+      chunk_done.get();
+    }
+  }
+
+ private:
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable task_available_;
+  bool stop_ = false;
+
+  void work() {
+    while(true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_available_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+        if(stop_ && tasks_.empty()) {
+          return;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+};
@@ -1,29 +1,88 @@
 #include <sentencepiece_processor.h>
 #include <sentencepiece_trainer.h>
 #include <spdlog/spdlog.h>
+#include <algorithm>
 #include <filesystem>
+#include <future>
+#include <random>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "line_reader.h"
 
 using sentencepiece::SentencePieceProcessor;
 using std::string;
+using std::vector;
+
+// Settings for training new SPM models
+struct VocabOptions {
+  size_t vocab_size = 8000;
+  // Lines sampled from the training data, 0 for all
+  size_t sample_size = 0;
+  size_t threads = 1;
+  uint64_t seed = 0;
+};
+
+using VocabPair = std::pair<std::unique_ptr<SentencePieceProcessor>, std::unique_ptr<SentencePieceProcessor>>;
 
 std::unique_ptr<SentencePieceProcessor> load_vocab(const string &spm_path);
-void create_vocab(const string &spm_path, const string &text_file, const size_t vocab_size);
-std::unique_ptr<SentencePieceProcessor> load_or_create_vocab(const string &spm_path, const string &text_file, const size_t &vocab_size);
-
-// If SPM model exists, loads it.
-// If SPM model doesn't exist, creates it.
-std::unique_ptr<SentencePieceProcessor> load_or_create_vocab(const string &spm_path,
-                                                             const string &text_file,
-                                                             const size_t &vocab_size) {
-  if(!std::filesystem::exists(spm_path + ".model")) {
-    // Create new vocab if file doesn't exist
-    spdlog::info("SPM model with prefix {} not found - Creating new model", spm_path);
-    create_vocab(spm_path, text_file, vocab_size);
-  }
-  auto spm_processor = load_vocab(spm_path);
-  return spm_processor;
+void create_vocab(const string &spm_path, const vector<string> &text_files, const VocabOptions &options);
+VocabPair load_or_create_vocabs(const vector<string> &spm_paths,
+                                const string &src_file,
+                                const string &trg_file,
+                                const VocabOptions &options,
+                                bool joint=false);
+
+// Loads the source and target SPM models, creating those that don't exist.
+// Missing source and target models are trained at the same time, each with half
+// of the trainer threads. A joint model is trained on both sides and, if the
+// paths differ, copied to the target path. A lone target model is refused with
+// --joint-vocab, since the two sides would no longer share one model
+VocabPair load_or_create_vocabs(const vector<string> &spm_paths,
+                                const string &src_file,
+                                const string &trg_file,
+                                const VocabOptions &options,
+                                bool joint) {
+  bool src_missing = !std::filesystem::exists(spm_paths[0] + ".model");
+  bool trg_missing = !std::filesystem::exists(spm_paths[1] + ".model");
+  if(joint) {
+    if(src_missing && !trg_missing && spm_paths[1] != spm_paths[0]) {
+      string message = fmt::format("--joint-vocab: SPM model {} exists but {} doesn't. Remove the first or "
+                                   "copy it to the second",
+                                   spm_paths[1] + ".model", spm_paths[0] + ".model");
+      spdlog::error(message);
+      throw std::runtime_error(message);
+    }
+    if(src_missing) {
+      spdlog::info("SPM model with prefix {} not found - Creating new joint model", spm_paths[0]);
+      create_vocab(spm_paths[0], {src_file, trg_file}, options);
+    }
+    if(trg_missing && spm_paths[1] != spm_paths[0]) {
+      spdlog::info("Copying joint SPM model {} to {}", spm_paths[0] + ".model", spm_paths[1] + ".model");
+      std::filesystem::copy_file(spm_paths[0] + ".model", spm_paths[1] + ".model");
+    }
+  }
+  else if(src_missing && trg_missing) {
+    spdlog::info("SPM models with prefixes {} and {} not found - Creating new models", spm_paths[0], spm_paths[1]);
+    VocabOptions half = options;
+    half.threads = std::max<size_t>(options.threads / 2, 1);
+    auto src_created = std::async(std::launch::async, [&]() { create_vocab(spm_paths[0], {src_file}, half); });
+    create_vocab(spm_paths[1], {trg_file}, half);
+    src_created.get();
+  }
+  else {
+    if(src_missing) {
+      spdlog::info("SPM model with prefix {} not found - Creating new model", spm_paths[0]);
+      create_vocab(spm_paths[0], {src_file}, options);
+    }
+    if(trg_missing) {
+      spdlog::info("SPM model with prefix {} not found - Creating new model", spm_paths[1]);
+      create_vocab(spm_paths[1], {trg_file}, options);
+    }
+  }
+  return {load_vocab(spm_paths[0]), load_vocab(spm_paths[1])};
 }
 
 // Loads an existing SPM model
@@ -40,16 +99,81 @@ std::unique_ptr<SentencePieceProcessor> load_vocab(const string &spm_path) {
   return spm_processor;
 }
 
-// Creates a new SPM model
-void create_vocab(const string &spm_path, const string &text_file, const size_t vocab_size) {
-  // TODO: Common vocab for multiple input files
+// Feeds the lines of text files, which may be compressed, to SentencePiece
+// training one file after the other
+class LineReaderIterator : public sentencepiece::SentenceIterator {
+ public:
+  explicit LineReaderIterator(const vector<string> &paths) : paths_(paths) { Next(); }
+  bool done() const override { return done_; }
+  void Next() override {
+    while(!(reader_ && reader_->getline(line_))) {
+      if(next_path_ >= paths_.size()) {
+        done_ = true;
+        return;
+      }
+      reader_ = std::make_unique<LineReader>(paths_[next_path_++]);
+    }
+  }
+  const string &value() const override { return line_; }
+  sentencepiece::util::Status status() const override { return sentencepiece::util::Status(); }
+
+ private:
+  const vector<string> paths_;
+  size_t next_path_ = 0;
+  std::unique_ptr<LineReader> reader_;
+  string line_;
+  bool done_ = false;
+};
+
+// Feeds SentencePiece training a uniform sample of sample_size lines of text
+// files, drawn by reservoir sampling while they are read, so that only the
+// sample is ever held in memory
+class SampledLinesIterator : public sentencepiece::SentenceIterator {
+ public:
+  SampledLinesIterator(const vector<string> &paths, size_t sample_size, uint64_t seed) {
+    std::mt19937_64 generator(seed);
+    LineReaderIterator input(paths);
+    size_t seen = 0;
+    for(; !input.done(); input.Next(), ++seen) {
+      if(lines_.size() < sample_size) {
+        lines_.push_back(input.value());
+      }
+      else {
+        size_t i = std::uniform_int_distribution<size_t>(0, seen)(generator);
+        if(i < sample_size) {
+          lines_[i] = input.value();
+        }
+      }
+    }
+    spdlog::info("Training SentencePiece on {} of {} lines", lines_.size(), seen);
+  }
+  bool done() const override { return next_ >= lines_.size(); }
+  void Next() override { ++next_; }
+  const string &value() const override { return lines_[next_]; }
+  sentencepiece::util::Status status() const override { return sentencepiece::util::Status(); }
+
+ private:
+  vector<string> lines_;
+  size_t next_ = 0;
+};
+
+// Creates a new SPM model from the lines of text_files
+void create_vocab(const string &spm_path, const vector<string> &text_files, const VocabOptions &options) {
   std::stringstream train_cmd;
   train_cmd << " --bos_id=-1 --eos_id=0 --unk_id=1"; // Non-negotiable
   train_cmd << " --hard_vocab_limit=false"; // Is this necessary?
-  train_cmd << " --vocab_size=" << vocab_size;
+  train_cmd << " --vocab_size=" << options.vocab_size;
+  train_cmd << " --num_threads=" << options.threads;
   train_cmd << " --model_prefix=" << spm_path;
-  train_cmd << " --input=" + text_file;
-  const auto train_status = sentencepiece::SentencePieceTrainer::Train(train_cmd.str());
+  // Text is read through LineReaders, which also decompress it on the fly
+  std::unique_ptr<sentencepiece::SentenceIterator> input;
+  if(options.sample_size > 0) {
+    input = std::make_unique<SampledLinesIterator>(text_files, options.sample_size, options.seed);
+  }
+  else {
+    input = std::make_unique<LineReaderIterator>(text_files);
+  }
+  const auto train_status = sentencepiece::SentencePieceTrainer::Train(train_cmd.str(), input.get());
   if(!train_status.ok()) {
     spdlog::error("SentencePiece training error: {}", train_status.ToString());
   }
@@ -1,8 +1,13 @@
+#include <ATen/Parallel.h>
+#include <ATen/ThreadLocalState.h>
+#include <exception>
+#include <future>
 #include "encoder.h"
+#include "rnn_utils.h"
 #include "types.h"
 
 BiDeepEncoderImpl::BiDeepEncoderImpl(const ModelOptions &model_options)
-    : type_(model_options.enc_type), skip_(model_options.skip) {
+    : type_(model_options.enc_type), skip_(model_options.skip), serial_(model_options.serial_encoder) {
   // Embedding
   emb_ = register_module("emb",
                          Embedding(EmbeddingOptions(model_options.src_vocab_size,
@@ -52,14 +57,53 @@ BiDeepEncoderImpl::BiDeepEncoderImpl(const ModelOptions &model_options)
   }
 }
 
+// Runs the backward stack on the libtorch inter-op pool while this thread runs
+// the forward stack, since they are independent until concatenated.
+// The pool thread takes over this thread's grad mode and other thread-local
+// state, so autograd records both stacks into the same graph. Both sides share
+// the intra-op thread pool
+// Returns: forward and backward outputs, each {seq_len, batch_size, rnn_dim}
+std::tuple<Tensor, Tensor> BiDeepEncoderImpl::forward_concurrently(const Tensor &emb_input, const Tensor &reverse_index) {
+  auto backward_done = std::make_shared<std::promise<Tensor>>();
+  auto backward_out = backward_done->get_future();
+  at::launch([this, &emb_input, &reverse_index, backward_done, caller_state = at::ThreadLocalState()]() {
+    at::ThreadLocalStateGuard state_guard(caller_state);
+    try {
+      backward_done->set_value(rnn_bw_->forward(emb_input, reverse_index));
+    }
+    catch(...) {
+      backward_done->set_exception(std::current_exception());
+    }
+  });
+  Tensor forward_out;
+  try {
+    forward_out = rnn_fw_->forward(emb_input, reverse_index);
+  }
+  catch(...) {
+    // The backward stack still reads the inputs
+    backward_out.wait();
+    throw;
+  }
+  return std::make_tuple(forward_out, backward_out.get());
+}
+
 // Returns {seq_len, batch_size, 2*rnn_dim}
 Tensor BiDeepEncoderImpl::forward(const MaskedData &input) {
   Tensor emb_input = emb_->forward(input.data);
-  Tensor out = torch::cat({rnn_fw_->forward(emb_input, input.lengths),
-                           rnn_bw_->forward(emb_input, input.lengths)},
-                           /*dim=*/-1);
+  // Shared by all backward layers
+  Tensor reverse_index = input.reverse_index.defined() ? input.reverse_index
+                                                       : reverse_padded_index(input.lengths, input.data.size(0));
+  Tensor forward_out, backward_out;
+  if(serial_) {
+    forward_out = rnn_fw_->forward(emb_input, reverse_index);
+    backward_out = rnn_bw_->forward(emb_input, reverse_index);
+  }
+  else {
+    std::tie(forward_out, backward_out) = forward_concurrently(emb_input, reverse_index);
+  }
+  Tensor out = torch::cat({forward_out, backward_out}, /*dim=*/-1);
   if(type_ == EncoderType::bi_unidirectional) {
-    out = rnn_uni_->forward(out, input.lengths);
+    out = rnn_uni_->forward(out, reverse_index);
   }
   return out;
 }
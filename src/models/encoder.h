@@ -14,11 +14,14 @@ class BiDeepEncoderImpl : public Module {
   Tensor forward(const MaskedData &input);
 
  private:
+  std::tuple<Tensor, Tensor> forward_concurrently(const Tensor &emb_input, const Tensor &reverse_index);
+
   Embedding emb_{nullptr};
   StackedRNN rnn_fw_{nullptr};
   StackedRNN rnn_bw_{nullptr};
   StackedRNN rnn_uni_{nullptr};
   EncoderType type_;
   bool skip_;
+  bool serial_;
 };
 TORCH_MODULE(BiDeepEncoder);
@@ -1,17 +1,54 @@
+#include <cmath>
 #include "rnn.h"
 #include "rnn_utils.h"
 
 using torch::indexing::Ellipsis;
 
+namespace {
+// GRU update given the input-to-hidden projection of its input, computed
+// ahead, with the same gates as torch::nn::GRUCell
+// Input input_gates: {batch_size, 3*rnn_dim} or {3*rnn_dim}
+// Input state: {batch_size, rnn_dim}
+// Returns: {batch_size, rnn_dim}
+Tensor gru_hidden_step(const Tensor &input_gates,
+                       const Tensor &state,
+                       const Tensor &weight_hh,
+                       const Tensor &bias_hh) {
+  Tensor hidden_gates = torch::nn::functional::linear(state, weight_hh, bias_hh);
+  auto input_chunks = input_gates.chunk(3, -1);
+  auto hidden_chunks = hidden_gates.chunk(3, -1);
+  Tensor reset = torch::sigmoid(input_chunks[0] + hidden_chunks[0]);
+  Tensor update = torch::sigmoid(input_chunks[1] + hidden_chunks[1]);
+  Tensor candidate = torch::tanh(input_chunks[2] + reset * hidden_chunks[2]);
+  return candidate + update * (state - candidate);
+}
+} // namespace
+
+TransitionGRUCellImpl::TransitionGRUCellImpl(size_t hidden_dim) {
+  int64_t rnn_dim = hidden_dim;
+  // Initialised like GRUCell
+  double bound = 1.0 / std::sqrt(static_cast<double>(rnn_dim));
+  weight_hh = register_parameter("weight_hh", torch::empty({3 * rnn_dim, rnn_dim}).uniform_(-bound, bound));
+  bias_ih = register_parameter("bias_ih", torch::empty({3 * rnn_dim}).uniform_(-bound, bound));
+  bias_hh = register_parameter("bias_hh", torch::empty({3 * rnn_dim}).uniform_(-bound, bound));
+}
+
+// Input state: {batch_size, rnn_dim}
+// Returns: {batch_size, rnn_dim}
+Tensor TransitionGRUCellImpl::forward(const Tensor &state) {
+  // The projection of a zero input is just the input bias
+  return gru_hidden_step(bias_ih, state, weight_hh, bias_hh);
+}
+
 DTGRUCellImpl::DTGRUCellImpl(size_t input_dim,
                              size_t hidden_dim,
                              size_t transition_depth)
     : rnn_dim_(hidden_dim) {
-  for(size_t i = 1; i <= transition_depth; ++i) {
+  dt_cell_->push_back(register_module("cell1", GRUCell(input_dim, rnn_dim_)));
+  for(size_t i = 2; i <= transition_depth; ++i) {
     dt_cell_->push_back(
       register_module("cell" + std::to_string(i),
-                      GRUCell(input_dim, rnn_dim_)));
-    input_dim = rnn_dim_; // For layers > 1
+                      TransitionGRUCell(rnn_dim_)));
   }
 }
 
@@ -19,16 +56,15 @@ CondDTGRUCellImpl::CondDTGRUCellImpl(size_t input_dim,
                                      size_t hidden_dim,
                                      size_t transition_depth)
     : rnn_dim_(hidden_dim) {
-  for(size_t i = 1; i <= transition_depth; ++i) {
+  dt_cell_->push_back(register_module("cell1", GRUCell(input_dim, rnn_dim_)));
+  if(transition_depth > 1) {
+    // Takes the attention context as input
+    dt_cell_->push_back(register_module("cell2", GRUCell(2 * rnn_dim_, rnn_dim_)));
+  }
+  for(size_t i = 3; i <= transition_depth; ++i) {
     dt_cell_->push_back(
       register_module("cell" + std::to_string(i),
-                      GRUCell(input_dim, rnn_dim_)));
-    if(i == 1) {
-      input_dim = 2 * rnn_dim_; // For second layer
-    }
-    else {
-      input_dim = rnn_dim_; // For layers > 1
-    }
+                      TransitionGRUCell(rnn_dim_)));
   }
   att_ = register_module("attention",
                          GlobalAttention(2 * rnn_dim_,
@@ -40,11 +76,9 @@ CondDTGRUCellImpl::CondDTGRUCellImpl(size_t input_dim,
 // Input state: {batch_size, rnn_dim}
 // Returns: {batch_size, rnn_dim}
 Tensor DTGRUCellImpl::step(const Tensor &input, const Tensor &state) {
-  Tensor curr_state = state;
-  Tensor curr_input = input;
-  for(size_t l = 0; l < dt_cell_->size(); ++l) {
-    curr_state = dt_cell_[l]->as<GRUCell>()->forward(curr_input, curr_state);
-    curr_input = torch::zeros_like(curr_state, torch::kFloat); // Zero input for higher layers
+  Tensor curr_state = dt_cell_[0]->as<GRUCell>()->forward(input, state);
+  for(size_t l = 1; l < dt_cell_->size(); ++l) {
+    curr_state = dt_cell_[l]->as<TransitionGRUCell>()->forward(curr_state); // No input for higher layers
   }
   return curr_state;
 }
@@ -54,32 +88,57 @@ Tensor DTGRUCellImpl::step(const Tensor &input, const Tensor &state) {
 // Input state: {batch_size, rnn_dim}
 // Returns: {batch_size, rnn_dim}
 std::tuple<Tensor, Tensor> CondDTGRUCellImpl::step(const Tensor &input, const Tensor &state) {
-  Tensor curr_state = state;
-  Tensor curr_input = input;
-  Tensor att_context;
-  for(size_t l = 0; l < dt_cell_->size(); ++l) {
-    curr_state = dt_cell_[l]->as<GRUCell>()->forward(curr_input, curr_state);
-    if(l == 0) {
-      curr_input = std::get<0>(att_->forward(curr_state));
-      att_context = curr_input.clone();
-    }
-    else {
-      curr_input = torch::zeros_like(curr_state, torch::kFloat); // Zero input for higher layers
-    }
+  Tensor curr_state = dt_cell_[0]->as<GRUCell>()->forward(input, state);
+  Tensor att_context = std::get<0>(att_->forward(curr_state));
+  if(dt_cell_->size() > 1) {
+    curr_state = dt_cell_[1]->as<GRUCell>()->forward(att_context, curr_state);
+  }
+  for(size_t l = 2; l < dt_cell_->size(); ++l) {
+    curr_state = dt_cell_[l]->as<TransitionGRUCell>()->forward(curr_state); // No input for higher layers
   }
   return std::tuple<Tensor, Tensor>(curr_state, att_context);
 }
 
-// Transduce entire sequence with deep transition cell
+// Time step of deep transition cell given the input projection of the first cell
+// Input input_gates: {batch_size, 3*rnn_dim}
+// Input state: {batch_size, rnn_dim}
+// Returns: {batch_size, rnn_dim}
+Tensor DTGRUCellImpl::step_projected(const Tensor &input_gates, const Tensor &state) {
+  auto first_cell = dt_cell_[0]->as<GRUCell>();
+  Tensor curr_state = gru_hidden_step(input_gates, state, first_cell->weight_hh, first_cell->bias_hh);
+  for(size_t l = 1; l < dt_cell_->size(); ++l) {
+    curr_state = dt_cell_[l]->as<TransitionGRUCell>()->forward(curr_state); // No input for higher layers
+  }
+  return curr_state;
+}
+
+// Transduce entire sequence with deep transition cell.
+// With transition depth > 1, the input projections of the first cell for all
+// time steps are computed in a single GEMM, so the recurrence is left with only
+// the hidden-to-hidden part
 // Input: {seq_len, batch_size, input_dim}
 // Returns: {seq_len, batch_size, rnn_dim}
 Tensor DTGRUCellImpl::forward(const Tensor &input) {
+  auto first_cell = dt_cell_[0]->as<GRUCell>();
+  if(dt_cell_->size() == 1) {
+    // Without transition this is a plain GRU, which runs the whole sequence in
+    // the fused kernel (cuDNN, or oneDNN on CPU) with the GRUCell's parameters
+    Tensor initial_state = torch::zeros({1, input.size(-2), static_cast<int64_t>(rnn_dim_)},
+                                        input.options()); // {1, batch_size, rnn_dim}
+    return std::get<0>(torch::gru(input, initial_state,
+                                  {first_cell->weight_ih, first_cell->weight_hh,
+                                   first_cell->bias_ih, first_cell->bias_hh},
+                                  /*has_biases=*/true, /*num_layers=*/1, /*dropout=*/0.0,
+                                  is_training(), /*bidirectional=*/false, /*batch_first=*/false));
+  }
   Tensor out = torch::empty({input.size(-3), input.size(-2), static_cast<int64_t>(rnn_dim_)},
                             input.device()); // {seq_len, batch_size, rnn_dim}
   Tensor state = torch::zeros({input.size(-2), static_cast<int64_t>(rnn_dim_)},
                               input.device()); // {batch_size, rnn_dim}
+  Tensor input_gates = torch::nn::functional::linear(input, first_cell->weight_ih,
+                                                     first_cell->bias_ih); // {seq_len, batch_size, 3*rnn_dim}
   for(int64_t t = 0; t < input.size(0); ++t) {
-    state = step(input.index({t, Ellipsis}), state);
+    state = step_projected(input_gates.index({t, Ellipsis}), state);
     out.index_put_({t, Ellipsis}, state);
   }
   return out;
@@ -141,9 +200,9 @@ std::tuple<Tensor, Tensor> StackedRNNImpl::step(const Tensor &input, const Tenso
 // Transduces entire sequence with StackedRNN and returns final layer outputs
 // Used in BiDeepEncoder
 // Input input: {seq_len, batch_size, input_dim}
-// Input lengths: {batch_size}
+// Input reverse_index: {seq_len, batch_size}, from reverse_padded_index
 // Returns: {seq_len, batch_size, rnn_dim}
-Tensor StackedRNNImpl::forward(const Tensor &input, const Tensor &lengths) {
+Tensor StackedRNNImpl::forward(const Tensor &input, const Tensor &reverse_index) {
   Tensor layer_input = input, layer_out;
   for(size_t l = 0; l < stack_->size(); ++l) {
     bool backward_layer =
@@ -152,12 +211,12 @@ Tensor StackedRNNImpl::forward(const Tensor &input, const Tensor &lengths) {
         || (dir_ == StackedRNNDir::alternating_forward && l % 2 != 0)); // Odd layers (1, 3, ...)
     if(backward_layer) {
       // Reverse layer inputs
-      layer_input = reverse_padded_sequence(layer_input, lengths);
+      layer_input = reverse_padded_sequence(layer_input, reverse_index);
     }
     layer_out = stack_[l]->as<DTGRUCell>()->forward(layer_input);
     if(backward_layer) {
       // Reverse layer outputs
-      layer_input = reverse_padded_sequence(layer_out, lengths);
+      layer_input = reverse_padded_sequence(layer_out, reverse_index);
     }
     if(skip_ && l > 0) {
       // Skip connections in higher layers
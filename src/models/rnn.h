@@ -8,6 +8,21 @@
 using namespace torch::nn;
 using torch::Tensor;
 
+// GRU cell with no input, for the higher cells of a deep transition:
+// GRUCell(0, state) without the input-to-hidden GEMM, of which only the input
+// bias remains. Parameters are named as in GRUCell, so checkpoints saved with
+// GRUCells load, their unused weight_ih aside
+class TransitionGRUCellImpl : public Module {
+ public:
+  explicit TransitionGRUCellImpl(size_t hidden_dim);
+  Tensor forward(const Tensor &state);
+
+  Tensor weight_hh;
+  Tensor bias_ih;
+  Tensor bias_hh;
+};
+TORCH_MODULE(TransitionGRUCell);
+
 // Deep Transition GRU Cell
 // v_{k,1} = GRU_{k,1}(in_k, state_k)
 // v_{k,t} = GRU_{k,t}(0, v_{k, t−1}) for 1 < k ≤ L_s
@@ -24,6 +39,8 @@ class DTGRUCellImpl : public Module {
  protected:
   ModuleList dt_cell_;
   size_t rnn_dim_;
+
+  Tensor step_projected(const Tensor &input_gates, const Tensor &state);
 };
 TORCH_MODULE(DTGRUCell);
 
@@ -52,7 +69,7 @@ class StackedRNNImpl : public Module {
                           StackedRNNDir dir=StackedRNNDir::forward,
                           bool skip=false);
 
-  Tensor forward(const Tensor &input, const Tensor &lengths);
+  Tensor forward(const Tensor &input, const Tensor &reverse_index);
   void insert_conditional_cell(size_t input_dim,
                                size_t hidden_dim,
                                size_t cell_depth);
@@ -2,12 +2,23 @@
 #include <CLI11/CLI11.hpp>
 #include <sentencepiece_processor.h>
 #include <spdlog/spdlog.h>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <chrono>
+#include <stdexcept>
 #include "cli_options.h"
 #include "data/vocab.h"
 #include "data/dataset.h"
+#include "data/pipeline.h"
+#include "data/corpus.h"
+#include "data/piece_encoder.h"
+#include "data/line_index.h"
+#include "data/line_reader.h"
+#include "data/binary_corpus.h"
+#include "data/cached_corpus.h"
+#include "data/corpus_stats.h"
+#include "data/mixture_corpus.h"
 #include "data/batch_transform.h"
 #include "models/encdec.h"
 #include "models/rnn.h"
@@ -21,37 +32,216 @@
 //   return ((loss->forward(output.permute({0,2,1}), target.data) * target.mask).sum(0) / target.lengths).mean();
 // }
 
-int main(int argc, char **argv) {
-  // Parse CLI arguments
-  CLI::App cli{"MTNess"};
-  std::shared_ptr<Options> options = configure_cli(cli);
-  CLI11_PARSE(cli, argc, argv);
+// Wraps an SPM model in a word cache, shared by everything that encodes with it
+std::shared_ptr<PieceEncoder> make_encoder(std::unique_ptr<SentencePieceProcessor> spm_processor,
+                                           const TrainingOptions &training_options,
+                                           bool reverse=false) {
+  auto encoder = std::make_shared<PieceEncoder>(std::move(spm_processor), training_options.piece_cache_size);
+  if(reverse) {
+    // Reverse source sentence (e.g. for Sutskever-style models)
+    encoder->set_extra_options("reverse:eos");
+  }
+  return encoder;
+}
+
+// Share of the words found in the cache of an encoder, for status lines
+string cache_hits(PieceEncoder &encoder) {
+  return encoder.caching() ? fmt::format("{:.1f}%", 100 * encoder.take_stats().hit_rate()) : "off";
+}
+
+// Settings for creating missing SPM models
+VocabOptions vocab_options(const Options &options) {
+  VocabOptions vocab_options;
+  vocab_options.vocab_size = options.model_options.vocab_size;
+  vocab_options.sample_size = options.training_options.spm_sample_size;
+  vocab_options.threads = options.training_options.spm_threads;
+  vocab_options.seed = options.training_options.seed;
+  return vocab_options;
+}
+
+// Encode training data once into a binary corpus for `train --binary-data`
+int preprocess(std::shared_ptr<Options> options) {
+  auto [src_spm_processor, trg_spm_processor] = load_or_create_vocabs(options->training_options.spm_models,
+                                                                      options->training_options.training_data[0],
+                                                                      options->training_options.training_data[1],
+                                                                      vocab_options(*options),
+                                                                      options->training_options.joint_vocab);
+  auto src_encoder = make_encoder(std::move(src_spm_processor),
+                                  options->training_options,
+                                  options->training_options.reverse_src);
+  auto trg_encoder = make_encoder(std::move(trg_spm_processor), options->training_options);
+  write_binary_corpus(options->training_options.training_data[0],
+                      options->training_options.training_data[1],
+                      *src_encoder,
+                      *trg_encoder,
+                      options->training_options.reverse_src,
+                      options->preprocess_options.output);
+  return 0;
+}
+
+// Scan training data and write its statistics as JSON, to choose batching and
+// length settings
+int stats(std::shared_ptr<Options> options) {
+  // Encoded the same way as for training
+  auto src_encoder = make_encoder(load_vocab(options->training_options.spm_models[0]), options->training_options);
+  auto trg_encoder = make_encoder(load_vocab(options->training_options.spm_models[1]), options->training_options);
+  auto start = std::chrono::high_resolution_clock::now();
+  auto corpus_stats = scan_corpus(options->training_options.training_data[0],
+                                  options->training_options.training_data[1],
+                                  *src_encoder,
+                                  *trg_encoder,
+                                  options->stats_options.threads);
+  auto time_passed = std::chrono::duration_cast<std::chrono::duration<double>>(
+      std::chrono::high_resolution_clock::now() - start);
+  spdlog::info("Scanned {} sentence pairs in {:.1f}s", corpus_stats.lines, time_passed.count());
+  if(options->stats_options.output == "-") {
+    corpus_stats.write_json(std::cout);
+  }
+  else {
+    std::ofstream out(options->stats_options.output);
+    corpus_stats.write_json(out);
+    spdlog::info("Wrote corpus statistics to {}", options->stats_options.output);
+  }
+  return 0;
+}
+
+// Formats seconds as h:mm:ss
+string format_duration(double seconds) {
+  auto total = static_cast<int64_t>(seconds);
+  return fmt::format("{}:{:02d}:{:02d}", total / 3600, (total / 60) % 60, total % 60);
+}
+
+// Share of the positions in a padded batch that are padding
+double padding_percent(int64_t tokens, int64_t padded_tokens) {
+  return padded_tokens > 0 ? 100.0 * (padded_tokens - tokens) / padded_tokens : 0.0;
+}
 
-  // Load or create SPM models
-  auto src_spm_processor = load_or_create_vocab(options->training_options.spm_models[0],
-                                                options->training_options.training_data[0],
-                                                options->model_options.vocab_size);
-  auto trg_spm_processor = load_or_create_vocab(options->training_options.spm_models[1],
-                                                options->training_options.training_data[1],
-                                                options->model_options.vocab_size);
-  options->model_options.src_vocab_size = src_spm_processor->GetPieceSize();
-  options->model_options.trg_vocab_size = trg_spm_processor->GetPieceSize();
-
-  // Initialise dataset and dataloader
-  auto dataset = torch::data::datasets::make_shared_dataset<TranslationDataset>(
-                     options->training_options.training_data[0],
-                     options->training_options.training_data[1],
-                     std::move(src_spm_processor),
-                     std::move(trg_spm_processor),
-                     options->training_options.maxibatch_size,
-                     options->training_options.maxi_sort)
-                     .map(PadAndStack<>());
-  auto dataloader = torch::data::make_data_loader(
-      std::move(dataset),
-      std::move(DataLoaderOptions()
-                  .batch_size(options->training_options.batch_size)
-                  .workers(1) // Make dataset thread-safe before changing this
-                  .enforce_ordering(true)));
+// Reading settings for shard `shard` of the training data
+CorpusOptions corpus_options(const TrainingOptions &training_options, size_t shard) {
+  CorpusOptions corpus_options;
+  corpus_options.shard = shard;
+  corpus_options.num_shards = training_options.data_workers;
+  corpus_options.shuffle_block = training_options.shuffle ? training_options.shuffle_block : 0;
+  corpus_options.seed = training_options.seed;
+  corpus_options.encode_threads = training_options.encode_threads;
+  return corpus_options;
+}
+
+int train(std::shared_ptr<Options> options) {
+  // One corpus shard per data worker
+  const size_t workers = options->training_options.data_workers;
+  vector<std::unique_ptr<Corpus>> shard_corpora;
+  // Shared by all corpora that encode text
+  std::shared_ptr<PieceEncoder> src_encoder, trg_encoder;
+  if(!options->training_options.stream_data.empty()) {
+    // Unbounded stream, read by a single shard. SPM models must already exist
+    src_encoder = make_encoder(load_vocab(options->training_options.spm_models[0]),
+                               options->training_options,
+                               options->training_options.reverse_src);
+    trg_encoder = make_encoder(load_vocab(options->training_options.spm_models[1]), options->training_options);
+    options->model_options.src_vocab_size = src_encoder->processor().GetPieceSize();
+    options->model_options.trg_vocab_size = trg_encoder->processor().GetPieceSize();
+    if(workers > 1) {
+      spdlog::warn("--stream-data is read by a single data worker");
+    }
+    options->training_options.data_workers = 1;
+    shard_corpora.emplace_back(std::make_unique<PipeCorpus>(options->training_options.stream_data,
+                                                            src_encoder,
+                                                            trg_encoder,
+                                                            options->training_options.shuffle
+                                                                ? options->training_options.stream_reservoir : 0,
+                                                            corpus_options(options->training_options, 0)));
+  }
+  else if(!options->training_options.binary_data.empty()) {
+    // Pre-encoded data. SPM models are only needed for vocab sizes
+    auto src_spm_processor = load_vocab(options->training_options.spm_models[0]);
+    auto trg_spm_processor = load_vocab(options->training_options.spm_models[1]);
+    options->model_options.src_vocab_size = src_spm_processor->GetPieceSize();
+    options->model_options.trg_vocab_size = trg_spm_processor->GetPieceSize();
+    for(size_t shard = 0; shard < workers; ++shard) {
+      auto corpus = std::make_unique<BinaryCorpus>(options->training_options.binary_data,
+                                                   corpus_options(options->training_options, shard));
+      // Source ids were reversed, or not, once and for all by `mtness preprocess`
+      if(corpus->reversed_src() != options->training_options.reverse_src) {
+        string message = fmt::format("{} was preprocessed {} --reverse-src, but training runs {} it",
+                                     options->training_options.binary_data,
+                                     corpus->reversed_src() ? "with" : "without",
+                                     options->training_options.reverse_src ? "with" : "without");
+        spdlog::error(message);
+        throw std::runtime_error(message);
+      }
+      shard_corpora.emplace_back(std::move(corpus));
+    }
+  }
+  else {
+    const auto &training_data = options->training_options.training_data;
+    // Load or create SPM models, trained on the first corpus
+    auto [src_spm_processor, trg_spm_processor] = load_or_create_vocabs(options->training_options.spm_models,
+                                                                        training_data[0],
+                                                                        training_data[1],
+                                                                        vocab_options(*options),
+                                                                        options->training_options.joint_vocab);
+    src_encoder = make_encoder(std::move(src_spm_processor),
+                               options->training_options,
+                               options->training_options.reverse_src);
+    trg_encoder = make_encoder(std::move(trg_spm_processor), options->training_options);
+    options->model_options.src_vocab_size = src_encoder->processor().GetPieceSize();
+    options->model_options.trg_vocab_size = trg_encoder->processor().GetPieceSize();
+    // Compressed files can't be indexed and are read as streams
+    const size_t num_corpora = training_data.size() / 2;
+    vector<bool> stream(num_corpora);
+    vector<std::shared_ptr<const LineIndex>> src_indices(num_corpora), trg_indices(num_corpora);
+    for(size_t k = 0; k < num_corpora; ++k) {
+      stream[k] = LineReader::is_compressed(training_data[2 * k]) || LineReader::is_compressed(training_data[2 * k + 1]);
+      if(!stream[k]) {
+        src_indices[k] = std::make_shared<const LineIndex>(training_data[2 * k]);
+        trg_indices[k] = std::make_shared<const LineIndex>(training_data[2 * k + 1]);
+      }
+    }
+    for(size_t shard = 0; shard < workers; ++shard) {
+      vector<std::unique_ptr<Corpus>> corpora;
+      for(size_t k = 0; k < num_corpora; ++k) {
+        std::unique_ptr<Corpus> corpus;
+        if(stream[k]) {
+          corpus = std::make_unique<StreamTextCorpus>(training_data[2 * k],
+                                                      training_data[2 * k + 1],
+                                                      src_encoder,
+                                                      trg_encoder,
+                                                      corpus_options(options->training_options, shard));
+        }
+        else {
+          corpus = std::make_unique<TextCorpus>(training_data[2 * k],
+                                                training_data[2 * k + 1],
+                                                src_indices[k],
+                                                trg_indices[k],
+                                                src_encoder,
+                                                trg_encoder,
+                                                corpus_options(options->training_options, shard));
+        }
+        if(options->training_options.cache_corpus_mb > 0) {
+          // Encode only once, the memory budget is split between shards and corpora
+          size_t max_bytes = (options->training_options.cache_corpus_mb << 20) / (workers * num_corpora);
+          corpus = std::make_unique<CachedCorpus>(std::move(corpus), max_bytes,
+                                                  corpus_options(options->training_options, shard));
+        }
+        corpora.emplace_back(std::move(corpus));
+      }
+      if(num_corpora == 1) {
+        shard_corpora.emplace_back(std::move(corpora[0]));
+      }
+      else {
+        shard_corpora.emplace_back(std::make_unique<MixtureCorpus>(std::move(corpora),
+                                                                   options->training_options.data_weights,
+                                                                   corpus_options(options->training_options, shard)));
+      }
+    }
+  }
+
+  // Initialise dataset and data pipeline
+  auto dataset = std::make_shared<TranslationDataset>(options->training_options, std::move(shard_corpora));
+  const auto epoch_size = dataset->size();
+  // --batch-size also sizes maxi-batches with --batch-tokens
+  BatchPipeline pipeline(*dataset, options->training_options);
 
   // Create model directory if it doesn't exist
   if(!std::filesystem::exists(options->training_options.model_dir)) {
@@ -60,6 +250,10 @@ int main(int argc, char **argv) {
 
   // Build model
   EncoderDecoder<BiDeepDecoder> model(options->model_options);
+  if(!options->training_options.resume.empty()) {
+    spdlog::info("Loading model from {}", options->training_options.resume);
+    torch::load(model, options->training_options.resume);
+  }
   model->to(options->training_options.device, /*non_blocking=*/true);
   model->print_params();
 
@@ -67,14 +261,74 @@ int main(int argc, char **argv) {
 
   auto optimizer = torch::optim::Adam(model->parameters(), torch::optim::AdamOptions(options->training_options.learning_rate));
 
+  size_t first_epoch = 1;
   size_t total_sentences = 0;
+  size_t epoch_sentences = 0;
   size_t words_since_last = 0;
+  // Real and padded tokens per side since the last status line
+  int64_t src_tokens_since_last = 0, trg_tokens_since_last = 0;
+  int64_t src_padded_since_last = 0, trg_padded_since_last = 0;
   size_t updates = 0;
+
+  // Saves the model, and in <path>.state everything else needed to resume training from it
+  auto save_checkpoint = [&](const string &path, size_t epoch) {
+    spdlog::info("Saving model to {}", path);
+    model->eval();
+    torch::save(model, path);
+    model->train();
+    torch::serialize::OutputArchive state, optimizer_state, dataset_state;
+    optimizer.save(optimizer_state);
+    dataset->save(dataset_state);
+    state.write("optimizer", optimizer_state);
+    state.write("dataset", dataset_state);
+    state.write("progress", torch::tensor({static_cast<int64_t>(epoch),
+                                           static_cast<int64_t>(updates),
+                                           static_cast<int64_t>(total_sentences)}));
+    state.save_to(path + ".state");
+  };
+
+  if(!options->training_options.resume.empty()) {
+    // Continue from the saved position in the data, without re-reading it
+    torch::serialize::InputArchive state, optimizer_state, dataset_state;
+    state.load_from(options->training_options.resume + ".state");
+    state.read("optimizer", optimizer_state);
+    optimizer.load(optimizer_state);
+    state.read("dataset", dataset_state);
+    dataset->load(dataset_state);
+    Tensor progress;
+    state.read("progress", progress);
+    first_epoch = progress[0].item<int64_t>();
+    updates = progress[1].item<int64_t>();
+    total_sentences = progress[2].item<int64_t>();
+    spdlog::info("Resuming epoch {} after {} updates", first_epoch, updates);
+  }
+
   auto last_time = std::chrono::high_resolution_clock::now();
 
   // Training loop
-  for(size_t epoch = 1; epoch <= options->training_options.epochs; ++epoch) {
-    for(auto& batch : *dataloader) {
+  // A stream has no epochs, it is trained on until it ends
+  const size_t last_epoch = options->training_options.stream_data.empty() ? options->training_options.epochs
+                                                                           : first_epoch;
+  for(size_t epoch = first_epoch; epoch <= last_epoch; ++epoch) {
+    epoch_sentences = 0;
+    auto epoch_start = std::chrono::high_resolution_clock::now();
+    pipeline.start_epoch();
+    while(auto next_batch = pipeline.next()) {
+      auto &batch = *next_batch;
+      // Padding statistics, before the lengths are moved to the GPU
+      int64_t src_tokens = batch.data.lengths.sum().item<int64_t>();
+      int64_t trg_tokens = batch.target.lengths.sum().item<int64_t>();
+      int64_t src_padded = batch.data.data.numel();
+      int64_t trg_padded = batch.target.data.numel();
+      spdlog::debug("Batch of {} sentences ||| Source padding: {:.1f}% ||| Target padding: {:.1f}%",
+                    batch.data.data.size(-1),
+                    padding_percent(src_tokens, src_padded),
+                    padding_percent(trg_tokens, trg_padded));
+      src_tokens_since_last += src_tokens;
+      trg_tokens_since_last += trg_tokens;
+      src_padded_since_last += src_padded;
+      trg_padded_since_last += trg_padded;
+
       // Move data to GPU if enabled
       batch.data.to(options->training_options.device);
       batch.target.to(options->training_options.device);
@@ -90,18 +344,41 @@ int main(int argc, char **argv) {
       // For display purposes
       ++updates;
       total_sentences += batch.data.data.size(-1);
-      words_since_last += batch.data.lengths.sum().item<int64_t>();
+      epoch_sentences += batch.data.data.size(-1);
+      words_since_last += src_tokens;
       if(updates % options->training_options.disp_freq == 0) {
         auto curr_time = std::chrono::high_resolution_clock::now();
         auto time_passed = std::chrono::duration_cast<std::chrono::duration<double>>(curr_time - last_time);
-        spdlog::info("Epoch: {} ||| Updates: {} ||| Sentences: {} ||| Words/second: {:.2f} ||| Loss: {:.5f}",
+        string progress;
+        if(epoch_size && *epoch_size > 0) {
+          // Extrapolate the rest of the epoch from the time spent on it so far
+          double fraction = std::min(1.0, static_cast<double>(epoch_sentences) / *epoch_size);
+          auto epoch_time = std::chrono::duration_cast<std::chrono::duration<double>>(curr_time - epoch_start);
+          progress = fmt::format(" ||| Progress: {:.1f}% ||| ETA: {}",
+                                 100 * fraction,
+                                 format_duration(epoch_time.count() * (1 - fraction) / fraction));
+        }
+        spdlog::info("Epoch: {} ||| Updates: {} ||| Sentences: {} ||| Words/second: {:.2f} ||| Loss: {:.5f}"
+                     " ||| Padding: {:.1f}% src, {:.1f}% trg{}",
                      epoch,
                      updates,
                      total_sentences,
                      words_since_last / time_passed.count(),
-                     loss.item<double>());
+                     loss.item<double>(),
+                     padding_percent(src_tokens_since_last, src_padded_since_last),
+                     padding_percent(trg_tokens_since_last, trg_padded_since_last),
+                     progress);
+        if(src_encoder) {
+          spdlog::info("Data pipeline ||| {} ||| Word cache hits: {} src, {} trg",
+                       pipeline.take_stats(), cache_hits(*src_encoder), cache_hits(*trg_encoder));
+        }
+        else {
+          spdlog::info("Data pipeline ||| {}", pipeline.take_stats());
+        }
         last_time = curr_time;
         words_since_last = 0;
+        src_tokens_since_last = trg_tokens_since_last = 0;
+        src_padded_since_last = trg_padded_since_last = 0;
       }
       if(updates % options->training_options.save_freq == 0) {
         // Save model
@@ -112,17 +389,33 @@ int main(int argc, char **argv) {
         else {
           save_path += "/model.pt";
         }
-        spdlog::info("Saving model to {}", save_path);
-        model->eval();
-        torch::save(model, save_path);
-        model->train();
+        save_checkpoint(save_path, epoch);
       }
     }
+    auto [dropped, cropped] = dataset->take_filter_counts();
+    if(dropped > 0 || cropped > 0) {
+      spdlog::info("Epoch {}: skipped {} sentence pairs over --max-length or --max-length-ratio, cropped {}",
+                   epoch, dropped, cropped);
+    }
   }
 
   // Save model
-  model->eval();
-  torch::save(model, options->training_options.model_dir + "/model.pt");
+  save_checkpoint(options->training_options.model_dir + "/model.pt", options->training_options.epochs + 1);
 
   return 0;
 }
+
+int main(int argc, char **argv) {
+  // Parse CLI arguments
+  CLI::App cli{"MTNess"};
+  std::shared_ptr<Options> options = configure_cli(cli);
+  CLI11_PARSE(cli, argc, argv);
+
+  if(cli.got_subcommand("preprocess")) {
+    return preprocess(options);
+  }
+  if(cli.got_subcommand("stats")) {
+    return stats(options);
+  }
+  return train(options);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <torch/torch.h>
+
+using torch::Tensor;
+
+// Gather index that reverses the non-padding part of sequences, keeping the
+// padding in place: index[t][b] = lengths[b]-1-t for t < lengths[b], else t.
+// Built in a few vectorized ops, and once per batch (MaskedData::reverse_index)
+// Input lengths: {batch_size}
+// Returns: {seq_len, batch_size}
+inline Tensor reverse_padded_index(const Tensor &lengths, int64_t seq_len) {
+  Tensor steps = torch::arange(seq_len, lengths.options().dtype(torch::kLong)).unsqueeze(1); // {seq_len, 1}
+  Tensor last = (lengths.to(torch::kLong) - 1).unsqueeze(0); // {1, batch_size}
+  return torch::where(steps <= last, last - steps, steps);
+}
@@ -19,6 +19,9 @@ struct MaskedData {
   void to(const torch::DeviceType &device, const bool non_blocking=true);
 
   Tensor data, mask, lengths;
+  // Optional {seq_len, batch_size} index reversing each sequence within its
+  // length (reverse_padded_index), built with source batches for backward RNN layers
+  Tensor reverse_index;
 };
 
 enum class StackedRNNDir {
@@ -44,10 +47,34 @@ static std::unordered_map<std::string, EncoderType> encoder_type_map{
 enum class MaxiBatchSortKey {
   source,
   target,
+  bucket,  // Group pairs with similar source and target lengths
   none
 };
 
 static std::unordered_map<std::string, MaxiBatchSortKey> maxi_sort_map{
     {"source", MaxiBatchSortKey::source},
     {"target", MaxiBatchSortKey::target},
+    {"bucket", MaxiBatchSortKey::bucket},
     {"none", MaxiBatchSortKey::none}};
+
+// What to do with sentence pairs over --max-length
+enum class MaxLengthMode {
+  crop,
+  skip
+};
+
+static std::unordered_map<std::string, MaxLengthMode> max_length_mode_map{
+    {"crop", MaxLengthMode::crop},
+    {"skip", MaxLengthMode::skip}};
+
+// Side(s) counted against the --batch-tokens budget
+enum class BatchTokensSide {
+  source,
+  target,
+  both
+};
+
+static std::unordered_map<std::string, BatchTokensSide> batch_tokens_side_map{
+    {"source", BatchTokensSide::source},
+    {"target", BatchTokensSide::target},
+    {"both", BatchTokensSide::both}};
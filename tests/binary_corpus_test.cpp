@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include "data/binary_corpus.h"
+#include "test_utils.h"
+
+namespace {
+class BinaryCorpusTest : public ::testing::Test {
+ protected:
+  TempDir dir_;
+  string src_path_ = dir_.path("train.src");
+  string trg_path_ = dir_.path("train.trg");
+  string binary_path_ = dir_.path("train.bin");
+  vector<vector<int>> src_ids_, trg_ids_;
+
+  void SetUp() override {
+    vector<string> src_lines = numbered_lines(250, "source"), trg_lines = numbered_lines(250, "target");
+    // Empty lines encode to eos alone
+    src_lines[7].clear();
+    write_file(src_path_, join_lines(src_lines));
+    write_file(trg_path_, join_lines(trg_lines));
+    auto src_encoder = make_test_encoder(src_path_, dir_.path("src"));
+    auto trg_encoder = make_test_encoder(trg_path_, dir_.path("trg"));
+    for(size_t i = 0; i < src_lines.size(); ++i) {
+      src_ids_.emplace_back();
+      trg_ids_.emplace_back();
+      src_encoder->encode(src_lines[i], src_ids_.back());
+      trg_encoder->encode(trg_lines[i], trg_ids_.back());
+    }
+    write_binary_corpus(src_path_, trg_path_, *src_encoder, *trg_encoder, false, binary_path_);
+  }
+};
+
+vector<vector<int>> to_vectors(const vector<IdSpan> &views) {
+  vector<vector<int>> ids;
+  for(const auto &view : views) {
+    ids.emplace_back(view.begin(), view.end());
+  }
+  return ids;
+}
+} // namespace
+
+TEST_F(BinaryCorpusTest, RoundTrips) {
+  BinaryCorpus corpus(binary_path_);
+  EXPECT_EQ(corpus.size(), src_ids_.size());
+  EXPECT_FALSE(corpus.reversed_src());
+  vector<vector<int>> src_ids, trg_ids;
+  read_all(corpus, src_ids, trg_ids);
+  EXPECT_EQ(src_ids, src_ids_);
+  EXPECT_EQ(trg_ids, trg_ids_);
+}
+
+TEST_F(BinaryCorpusTest, ViewsMatchCopies) {
+  BinaryCorpus corpus(binary_path_);
+  ASSERT_TRUE(corpus.has_views());
+  vector<IdSpan> src_views, trg_views;
+  vector<vector<int>> src_ids, trg_ids;
+  while(size_t num_pairs = corpus.read_views(64, src_views, trg_views)) {
+    EXPECT_EQ(num_pairs, src_views.size());
+    auto src_batch = to_vectors(src_views), trg_batch = to_vectors(trg_views);
+    src_ids.insert(src_ids.end(), src_batch.begin(), src_batch.end());
+    trg_ids.insert(trg_ids.end(), trg_batch.begin(), trg_batch.end());
+  }
+  EXPECT_EQ(src_ids, src_ids_);
+  EXPECT_EQ(trg_ids, trg_ids_);
+}
+
+TEST_F(BinaryCorpusTest, ShardsCoverCorpus) {
+  vector<vector<int>> all_src;
+  for(size_t shard = 0; shard < 4; ++shard) {
+    CorpusOptions options;
+    options.shard = shard;
+    options.num_shards = 4;
+    BinaryCorpus corpus(binary_path_, options);
+    vector<vector<int>> src_ids, trg_ids;
+    read_all(corpus, src_ids, trg_ids);
+    EXPECT_EQ(corpus.size(), src_ids.size());
+    all_src.insert(all_src.end(), src_ids.begin(), src_ids.end());
+  }
+  EXPECT_EQ(all_src, src_ids_);
+}
+
+TEST_F(BinaryCorpusTest, ResumesShuffledEpoch) {
+  CorpusOptions options;
+  options.shuffle_block = 10;
+  options.seed = 3;
+  BinaryCorpus corpus(binary_path_, options);
+  vector<vector<int>> src_ids, trg_ids, src_resumed, trg_resumed;
+  vector<int> src, trg;
+  for(int i = 0; i < 95; ++i) {
+    ASSERT_TRUE(corpus.next(src, trg));
+  }
+  auto state = corpus.state();
+  read_all(corpus, src_ids, trg_ids);
+  BinaryCorpus resumed(binary_path_, options);
+  resumed.restore(state);
+  read_all(resumed, src_resumed, trg_resumed);
+  EXPECT_EQ(src_resumed, src_ids);
+  EXPECT_EQ(trg_resumed, trg_ids);
+  EXPECT_EQ(src_ids.size(), src_ids_.size() - 95);
+}
+
+TEST_F(BinaryCorpusTest, RecordsReversedSource) {
+  auto src_encoder = make_test_encoder(src_path_, dir_.path("src_reversed"), "reverse:eos");
+  auto trg_encoder = make_test_encoder(trg_path_, dir_.path("trg_reversed"));
+  write_binary_corpus(src_path_, trg_path_, *src_encoder, *trg_encoder, true, dir_.path("reversed.bin"));
+  BinaryCorpus corpus(dir_.path("reversed.bin"));
+  EXPECT_TRUE(corpus.reversed_src());
+}
+
+TEST_F(BinaryCorpusTest, RejectsDamagedFiles) {
+  std::filesystem::resize_file(binary_path_, std::filesystem::file_size(binary_path_) - 8);
+  EXPECT_THROW(BinaryCorpus corpus(binary_path_), std::runtime_error);
+  write_file(binary_path_, string(sizeof(BinaryCorpusHeader), 'x'));
+  EXPECT_THROW(BinaryCorpus corpus(binary_path_), std::runtime_error);
+}
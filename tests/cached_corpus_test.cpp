@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include "data/cached_corpus.h"
+#include "test_utils.h"
+
+namespace {
+// Pairs whose ids take one to five varint bytes
+void make_pairs(size_t num_pairs, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) {
+  const vector<int> ids = {0, 1, 127, 128, 300, 16383, 16384, 70000, 2097152, 2147483647};
+  for(size_t i = 0; i < num_pairs; ++i) {
+    src_ids.push_back({ids[i % ids.size()], static_cast<int>(i), 2});
+    trg_ids.push_back({});
+    for(size_t t = 0; t < i % 5; ++t) {
+      trg_ids.back().push_back(ids[(i + t) % ids.size()]);
+    }
+  }
+}
+} // namespace
+
+TEST(CachedCorpusTest, ServesLaterEpochsFromMemory) {
+  vector<vector<int>> src, trg;
+  make_pairs(100, src, trg);
+  auto vector_corpus = std::make_unique<VectorCorpus>(src, trg);
+  const VectorCorpus &wrapped = *vector_corpus;
+  CachedCorpus corpus(std::move(vector_corpus), 1 << 20);
+  vector<vector<int>> src_ids, trg_ids;
+  for(int epoch = 0; epoch < 3; ++epoch) {
+    read_all(corpus, src_ids, trg_ids);
+    EXPECT_EQ(src_ids, src);
+    EXPECT_EQ(trg_ids, trg);
+    corpus.reset();
+  }
+  EXPECT_EQ(wrapped.pairs_read(), src.size());
+}
+
+TEST(CachedCorpusTest, ShufflesCachedPairs) {
+  vector<vector<int>> src, trg;
+  make_pairs(100, src, trg);
+  CorpusOptions options;
+  options.shuffle_block = 10;
+  CachedCorpus corpus(std::make_unique<VectorCorpus>(src, trg), 1 << 20, options);
+  vector<vector<int>> src_ids, trg_ids;
+  read_all(corpus, src_ids, trg_ids);
+  corpus.reset();
+  read_all(corpus, src_ids, trg_ids);
+  EXPECT_NE(src_ids, src);
+  for(size_t i = 0; i < src_ids.size(); ++i) {
+    size_t pair = std::find(src.begin(), src.end(), src_ids[i]) - src.begin();
+    ASSERT_LT(pair, src.size());
+    EXPECT_EQ(trg_ids[i], trg[pair]);
+  }
+  std::sort(src_ids.begin(), src_ids.end());
+  std::sort(src.begin(), src.end());
+  EXPECT_EQ(src_ids, src);
+}
+
+TEST(CachedCorpusTest, ResumesFromMemory) {
+  vector<vector<int>> src, trg;
+  make_pairs(100, src, trg);
+  CorpusOptions options;
+  options.shuffle_block = 10;
+  CachedCorpus corpus(std::make_unique<VectorCorpus>(src, trg), 1 << 20, options);
+  vector<vector<int>> src_ids, trg_ids, src_resumed, trg_resumed;
+  read_all(corpus, src_ids, trg_ids);
+  corpus.reset();
+  vector<int> src_pair, trg_pair;
+  for(int i = 0; i < 40; ++i) {
+    ASSERT_TRUE(corpus.next(src_pair, trg_pair));
+  }
+  auto state = corpus.state();
+  read_all(corpus, src_ids, trg_ids);
+
+  CachedCorpus resumed(std::make_unique<VectorCorpus>(src, trg), 1 << 20, options);
+  resumed.restore(state);
+  read_all(resumed, src_resumed, trg_resumed);
+  EXPECT_EQ(src_resumed, src_ids);
+  EXPECT_EQ(trg_resumed, trg_ids);
+}
+
+TEST(CachedCorpusTest, ReadsWrappedCorpusWhenOverBudget) {
+  vector<vector<int>> src, trg;
+  make_pairs(100, src, trg);
+  auto vector_corpus = std::make_unique<VectorCorpus>(src, trg);
+  const VectorCorpus &wrapped = *vector_corpus;
+  CachedCorpus corpus(std::move(vector_corpus), 256);
+  vector<vector<int>> src_ids, trg_ids;
+  for(int epoch = 0; epoch < 2; ++epoch) {
+    read_all(corpus, src_ids, trg_ids);
+    EXPECT_EQ(src_ids, src);
+    EXPECT_EQ(trg_ids, trg);
+    corpus.reset();
+  }
+  EXPECT_EQ(wrapped.pairs_read(), 2 * src.size());
+}
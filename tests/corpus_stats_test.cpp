@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include "data/corpus_stats.h"
+#include "test_utils.h"
+
+namespace {
+// Tokens and longest line of the lines encoded one by one
+std::pair<uint64_t, size_t> encoded_lengths(const PieceEncoder &encoder, const vector<string> &lines) {
+  uint64_t tokens = 0;
+  size_t max_length = 0;
+  vector<int> ids;
+  for(const auto &line : lines) {
+    encoder.encode(line, ids);
+    tokens += ids.size();
+    max_length = std::max(max_length, ids.size());
+  }
+  return {tokens, max_length};
+}
+} // namespace
+
+TEST(CorpusStatsTest, ScansEveryLineOnce) {
+  TempDir dir;
+  vector<string> src_lines = numbered_lines(500, "source"), trg_lines = numbered_lines(500, "target");
+  src_lines[3].clear();
+  write_file(dir.path("train.src"), join_lines(src_lines));
+  // Last line without a trailing newline
+  string trg_text = join_lines(trg_lines);
+  trg_text.pop_back();
+  write_file(dir.path("train.trg"), trg_text);
+  auto src_encoder = make_test_encoder(dir.path("train.src"), dir.path("src"));
+  auto trg_encoder = make_test_encoder(dir.path("train.trg"), dir.path("trg"));
+  auto [src_tokens, src_max_length] = encoded_lengths(*src_encoder, src_lines);
+  auto [trg_tokens, trg_max_length] = encoded_lengths(*trg_encoder, trg_lines);
+
+  for(size_t threads : {1, 3}) {
+    CorpusStats stats = scan_corpus(dir.path("train.src"), dir.path("train.trg"), *src_encoder, *trg_encoder,
+                                    threads);
+    EXPECT_EQ(stats.lines, 500u);
+    EXPECT_EQ(stats.src.tokens, src_tokens);
+    EXPECT_EQ(stats.trg.tokens, trg_tokens);
+    EXPECT_EQ(stats.src.max_length, src_max_length);
+    EXPECT_EQ(stats.trg.max_length, trg_max_length);
+    EXPECT_EQ(stats.src.empty_lines, 1u);
+    EXPECT_EQ(stats.trg.empty_lines, 0u);
+  }
+}
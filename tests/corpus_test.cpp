@@ -0,0 +1,193 @@
+#include <gtest/gtest.h>
+#include <zlib.h>
+#include <set>
+#include "data/corpus.h"
+#include "data/line_index.h"
+#include "test_utils.h"
+
+namespace {
+const size_t kNumPairs = 300;
+
+// Parallel text files and the ids each pair should encode to
+class CorpusTest : public ::testing::Test {
+ protected:
+  TempDir dir_;
+  string src_path_ = dir_.path("train.src");
+  string trg_path_ = dir_.path("train.trg");
+  vector<string> src_lines_ = numbered_lines(kNumPairs, "source");
+  vector<string> trg_lines_ = numbered_lines(kNumPairs, "target");
+  std::shared_ptr<PieceEncoder> src_encoder_, trg_encoder_;
+  vector<vector<int>> src_ids_, trg_ids_;
+
+  void SetUp() override {
+    write_file(src_path_, join_lines(src_lines_));
+    write_file(trg_path_, join_lines(trg_lines_));
+    src_encoder_ = make_test_encoder(src_path_, dir_.path("src"));
+    trg_encoder_ = make_test_encoder(trg_path_, dir_.path("trg"));
+    for(size_t i = 0; i < kNumPairs; ++i) {
+      src_ids_.emplace_back();
+      trg_ids_.emplace_back();
+      src_encoder_->encode(src_lines_[i], src_ids_.back());
+      trg_encoder_->encode(trg_lines_[i], trg_ids_.back());
+    }
+  }
+
+  std::unique_ptr<TextCorpus> text_corpus(const CorpusOptions &options) {
+    return std::make_unique<TextCorpus>(src_path_, trg_path_,
+                                        std::make_shared<const LineIndex>(src_path_),
+                                        std::make_shared<const LineIndex>(trg_path_),
+                                        src_encoder_, trg_encoder_, options);
+  }
+
+  void write_gzip_copies() {
+    for(const auto &path : {src_path_, trg_path_}) {
+      gzFile file = gzopen((path + ".gz").c_str(), "wb");
+      ASSERT_NE(file, nullptr);
+      string text = path == src_path_ ? join_lines(src_lines_) : join_lines(trg_lines_);
+      gzwrite(file, text.data(), text.size());
+      gzclose(file);
+    }
+  }
+
+  // Checks that the pairs read are the pairs of the files, each read once
+  void expect_pairs_of_files(const vector<vector<int>> &src_ids, const vector<vector<int>> &trg_ids) {
+    std::multiset<std::pair<vector<int>, vector<int>>> read, expected;
+    for(size_t i = 0; i < src_ids.size(); ++i) {
+      read.emplace(src_ids[i], trg_ids[i]);
+    }
+    for(size_t i = 0; i < kNumPairs; ++i) {
+      expected.emplace(src_ids_[i], trg_ids_[i]);
+    }
+    EXPECT_TRUE(read == expected);
+  }
+};
+
+// Reads a corpus to its end with read(), in batches of batch_size
+void read_batches(Corpus &corpus, size_t batch_size, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) {
+  src_ids.clear();
+  trg_ids.clear();
+  vector<vector<int>> src_batch, trg_batch;
+  while(size_t num_pairs = corpus.read(batch_size, src_batch, trg_batch)) {
+    src_ids.insert(src_ids.end(), src_batch.begin(), src_batch.begin() + num_pairs);
+    trg_ids.insert(trg_ids.end(), trg_batch.begin(), trg_batch.begin() + num_pairs);
+  }
+}
+} // namespace
+
+TEST_F(CorpusTest, TextCorpusReadsInOrder) {
+  vector<vector<int>> src_ids, trg_ids;
+  auto corpus = text_corpus({});
+  EXPECT_EQ(corpus->size(), kNumPairs);
+  read_all(*corpus, src_ids, trg_ids);
+  EXPECT_EQ(src_ids, src_ids_);
+  EXPECT_EQ(trg_ids, trg_ids_);
+
+  // Batches encoded across threads, in the second epoch
+  CorpusOptions options;
+  options.encode_threads = 3;
+  corpus = text_corpus(options);
+  read_all(*corpus, src_ids, trg_ids);
+  corpus->reset();
+  read_batches(*corpus, 64, src_ids, trg_ids);
+  EXPECT_EQ(src_ids, src_ids_);
+  EXPECT_EQ(trg_ids, trg_ids_);
+}
+
+TEST_F(CorpusTest, TextCorpusShardsAndShuffles) {
+  vector<vector<int>> all_src, all_trg;
+  for(size_t shard = 0; shard < 3; ++shard) {
+    CorpusOptions options;
+    options.shard = shard;
+    options.num_shards = 3;
+    options.shuffle_block = 16;
+    options.seed = 1;
+    vector<vector<int>> src_ids, trg_ids;
+    auto corpus = text_corpus(options);
+    read_batches(*corpus, 50, src_ids, trg_ids);
+    EXPECT_EQ(src_ids.size(), kNumPairs / 3);
+    all_src.insert(all_src.end(), src_ids.begin(), src_ids.end());
+    all_trg.insert(all_trg.end(), trg_ids.begin(), trg_ids.end());
+  }
+  EXPECT_EQ(all_src.size(), kNumPairs);
+  expect_pairs_of_files(all_src, all_trg);
+  EXPECT_NE(all_src, src_ids_);
+}
+
+TEST_F(CorpusTest, TextCorpusResumes) {
+  CorpusOptions options;
+  options.shuffle_block = 16;
+  auto corpus = text_corpus(options);
+  vector<vector<int>> src_batch, trg_batch, src_ids, trg_ids, src_resumed, trg_resumed;
+  corpus->read(100, src_batch, trg_batch);
+  auto state = corpus->state();
+  read_batches(*corpus, 30, src_ids, trg_ids);
+  auto resumed = text_corpus(options);
+  resumed->restore(state);
+  read_batches(*resumed, 30, src_resumed, trg_resumed);
+  EXPECT_EQ(src_resumed, src_ids);
+  EXPECT_EQ(trg_resumed, trg_ids);
+}
+
+TEST_F(CorpusTest, StreamTextCorpusReadsCompressedFiles) {
+  write_gzip_copies();
+  StreamTextCorpus corpus(src_path_ + ".gz", trg_path_ + ".gz", src_encoder_, trg_encoder_);
+  vector<vector<int>> src_ids, trg_ids;
+  for(int epoch = 0; epoch < 2; ++epoch) {
+    read_batches(corpus, 64, src_ids, trg_ids);
+    EXPECT_EQ(src_ids, src_ids_);
+    EXPECT_EQ(trg_ids, trg_ids_);
+    corpus.reset();
+  }
+}
+
+TEST_F(CorpusTest, StreamTextCorpusShardsShufflesAndResumes) {
+  write_gzip_copies();
+  vector<vector<int>> all_src, all_trg;
+  for(size_t shard = 0; shard < 2; ++shard) {
+    CorpusOptions options;
+    options.shard = shard;
+    options.num_shards = 2;
+    options.shuffle_block = 20;
+    options.encode_threads = 2;
+    StreamTextCorpus corpus(src_path_ + ".gz", trg_path_ + ".gz", src_encoder_, trg_encoder_, options);
+    vector<vector<int>> src_batch, trg_batch, src_ids, trg_ids;
+    corpus.read(35, src_batch, trg_batch);
+    all_src.insert(all_src.end(), src_batch.begin(), src_batch.begin() + 35);
+    all_trg.insert(all_trg.end(), trg_batch.begin(), trg_batch.begin() + 35);
+    auto state = corpus.state();
+    read_batches(corpus, 40, src_ids, trg_ids);
+    all_src.insert(all_src.end(), src_ids.begin(), src_ids.end());
+    all_trg.insert(all_trg.end(), trg_ids.begin(), trg_ids.end());
+
+    StreamTextCorpus resumed(src_path_ + ".gz", trg_path_ + ".gz", src_encoder_, trg_encoder_, options);
+    resumed.restore(state);
+    vector<vector<int>> src_resumed, trg_resumed;
+    read_batches(resumed, 40, src_resumed, trg_resumed);
+    EXPECT_EQ(src_resumed, src_ids);
+    EXPECT_EQ(trg_resumed, trg_ids);
+  }
+  EXPECT_EQ(all_src.size(), kNumPairs);
+  expect_pairs_of_files(all_src, all_trg);
+}
+
+TEST_F(CorpusTest, PipeCorpusReadsTabSeparatedPairs) {
+  string text;
+  for(size_t i = 0; i < kNumPairs; ++i) {
+    text += src_lines_[i] + "\t" + trg_lines_[i] + "\n";
+    if(i == 10) {
+      text += "a line without a tab\n";
+    }
+  }
+  write_file(dir_.path("stream.tsv"), text);
+  PipeCorpus in_order(dir_.path("stream.tsv"), src_encoder_, trg_encoder_, 0);
+  vector<vector<int>> src_ids, trg_ids;
+  read_batches(in_order, 64, src_ids, trg_ids);
+  EXPECT_EQ(src_ids, src_ids_);
+  EXPECT_EQ(trg_ids, trg_ids_);
+
+  PipeCorpus shuffled(dir_.path("stream.tsv"), src_encoder_, trg_encoder_, 32);
+  read_batches(shuffled, 64, src_ids, trg_ids);
+  EXPECT_EQ(src_ids.size(), kNumPairs);
+  expect_pairs_of_files(src_ids, trg_ids);
+  EXPECT_NE(src_ids, src_ids_);
+}
@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include "data/line_index.h"
+#include "test_utils.h"
+
+namespace {
+vector<uint64_t> offsets(const LineIndex &index) {
+  vector<uint64_t> offsets;
+  for(size_t line = 0; line <= index.size(); ++line) {
+    offsets.push_back(index.offset(line));
+  }
+  return offsets;
+}
+} // namespace
+
+TEST(LineIndexTest, IndexesLineStarts) {
+  TempDir dir;
+  write_file(dir.path("text.txt"), "first\n\nthird\n");
+  LineIndex index(dir.path("text.txt"));
+  EXPECT_EQ(index.size(), 3u);
+  EXPECT_EQ(offsets(index), vector<uint64_t>({0, 6, 7, 13}));
+
+  // The last line counts without a trailing newline
+  write_file(dir.path("unterminated.txt"), "first\nlast");
+  LineIndex unterminated(dir.path("unterminated.txt"));
+  EXPECT_EQ(offsets(unterminated), vector<uint64_t>({0, 6, 10}));
+}
+
+TEST(LineIndexTest, ReusesCacheUntilFileChanges) {
+  TempDir dir;
+  string path = dir.path("text.txt");
+  write_file(path, join_lines(numbered_lines(1000, "line")));
+  vector<uint64_t> expected = offsets(LineIndex(path));
+  ASSERT_TRUE(std::filesystem::exists(path + ".idx"));
+  auto cache_time = std::filesystem::last_write_time(path + ".idx");
+  EXPECT_EQ(offsets(LineIndex(path)), expected);
+  EXPECT_EQ(std::filesystem::last_write_time(path + ".idx"), cache_time);
+
+  write_file(path, "a\nb\n");
+  LineIndex changed(path);
+  EXPECT_EQ(offsets(changed), vector<uint64_t>({0, 2, 4}));
+}
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include <sys/stat.h>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include "data/line_reader.h"
+#include "test_utils.h"
+
+namespace {
+void write_gzip(const string &path, const string &content) {
+  gzFile file = gzopen(path.c_str(), "wb");
+  ASSERT_NE(file, nullptr);
+  ASSERT_EQ(gzwrite(file, content.data(), content.size()), static_cast<int>(content.size()));
+  gzclose(file);
+}
+
+#ifdef USE_ZSTD
+void write_zstd(const string &path, const string &content) {
+  string compressed(ZSTD_compressBound(content.size()), '\0');
+  size_t size = ZSTD_compress(compressed.data(), compressed.size(), content.data(), content.size(), 3);
+  ASSERT_FALSE(ZSTD_isError(size));
+  compressed.resize(size);
+  write_file(path, compressed);
+}
+#endif
+
+vector<string> read_lines(LineReader &reader) {
+  vector<string> lines;
+  for(string line; reader.getline(line);) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+// Drops the last bytes of a file
+void truncate_file(const string &path, size_t bytes) {
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - bytes);
+}
+
+// Lines totalling several 4 MB chunks, which compress well enough for a
+// decompressor to hold back output when a chunk fills up
+vector<string> long_text() {
+  vector<string> lines;
+  for(size_t i = 0; i < 600000; ++i) {
+    lines.push_back("the same line over and over " + std::to_string(i % 7));
+  }
+  return lines;
+}
+} // namespace
+
+TEST(LineReaderTest, ReadsPlainText) {
+  TempDir dir;
+  vector<string> lines = {"first line", "", "third line"};
+  write_file(dir.path("text.txt"), join_lines(lines));
+  LineReader reader(dir.path("text.txt"));
+  EXPECT_FALSE(LineReader::is_compressed(dir.path("text.txt")));
+  EXPECT_EQ(read_lines(reader), lines);
+}
+
+TEST(LineReaderTest, ReadsLastLineWithoutNewline) {
+  TempDir dir;
+  write_file(dir.path("text.txt"), "first\nlast");
+  LineReader reader(dir.path("text.txt"));
+  EXPECT_EQ(read_lines(reader), vector<string>({"first", "last"}));
+}
+
+TEST(LineReaderTest, ReadsLinesAcrossChunks) {
+  TempDir dir;
+  vector<string> lines = long_text();
+  // A line longer than a whole chunk
+  lines.insert(lines.begin() + 1000, string(5 << 20, 'x'));
+  write_file(dir.path("text.txt"), join_lines(lines));
+  LineReader reader(dir.path("text.txt"));
+  EXPECT_EQ(read_lines(reader), lines);
+}
+
+TEST(LineReaderTest, ReopenStartsOver) {
+  TempDir dir;
+  vector<string> lines = long_text();
+  write_file(dir.path("text.txt"), join_lines(lines));
+  LineReader reader(dir.path("text.txt"));
+  string line;
+  ASSERT_TRUE(reader.getline(line));
+  reader.reopen();
+  EXPECT_EQ(read_lines(reader), lines);
+}
+
+TEST(LineReaderTest, PipeCarriesOnAfterReopen) {
+  TempDir dir;
+  ASSERT_EQ(mkfifo(dir.path("pipe").c_str(), 0600), 0);
+  vector<string> lines = {"first line", "second line", "third line"};
+  std::thread writer([&]() {
+    std::ofstream pipe(dir.path("pipe"));
+    pipe << join_lines(lines);
+  });
+  LineReader reader(dir.path("pipe"));
+  string line;
+  ASSERT_TRUE(reader.getline(line));
+  EXPECT_EQ(line, lines[0]);
+  // Keeps the lines already read ahead instead of starting over
+  reader.reopen();
+  EXPECT_EQ(read_lines(reader), vector<string>(lines.begin() + 1, lines.end()));
+  writer.join();
+}
+
+TEST(LineReaderTest, ReadsGzip) {
+  TempDir dir;
+  vector<string> lines = long_text();
+  write_gzip(dir.path("text.gz"), join_lines(lines));
+  LineReader reader(dir.path("text.gz"));
+  EXPECT_TRUE(LineReader::is_compressed(dir.path("text.gz")));
+  EXPECT_EQ(read_lines(reader), lines);
+}
+
+TEST(LineReaderTest, RejectsTruncatedGzip) {
+  TempDir dir;
+  write_gzip(dir.path("text.gz"), join_lines(long_text()));
+  truncate_file(dir.path("text.gz"), 100);
+  LineReader reader(dir.path("text.gz"));
+  EXPECT_THROW(read_lines(reader), std::runtime_error);
+}
+
+#ifdef USE_ZSTD
+TEST(LineReaderTest, ReadsZstd) {
+  TempDir dir;
+  vector<string> lines = long_text();
+  write_zstd(dir.path("text.zst"), join_lines(lines));
+  LineReader reader(dir.path("text.zst"));
+  EXPECT_TRUE(LineReader::is_compressed(dir.path("text.zst")));
+  EXPECT_EQ(read_lines(reader), lines);
+}
+
+TEST(LineReaderTest, RejectsTruncatedZstd) {
+  TempDir dir;
+  write_zstd(dir.path("text.zst"), join_lines(long_text()));
+  truncate_file(dir.path("text.zst"), 5);
+  LineReader reader(dir.path("text.zst"));
+  EXPECT_THROW(read_lines(reader), std::runtime_error);
+}
+#endif
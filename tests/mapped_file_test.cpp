@@ -0,0 +1,33 @@
+#include <gtest/gtest.h>
+#include <cerrno>
+#include "data/mapped_file.h"
+#include "test_utils.h"
+
+TEST(MappedFileTest, MapsWholeFile) {
+  TempDir dir;
+  write_file(dir.path("text"), "first line\nsecond line\n");
+  MappedFile file;
+  ASSERT_TRUE(file.map(dir.path("text")));
+  EXPECT_EQ(string(file.data(), file.size()), "first line\nsecond line\n");
+
+  // Moving hands over the mapping
+  MappedFile moved(std::move(file));
+  EXPECT_EQ(file.data(), nullptr);
+  EXPECT_EQ(string(moved.data(), moved.size()), "first line\nsecond line\n");
+}
+
+TEST(MappedFileTest, MapsEmptyFile) {
+  TempDir dir;
+  write_file(dir.path("empty"), "");
+  MappedFile file;
+  ASSERT_TRUE(file.map(dir.path("empty")));
+  EXPECT_EQ(file.size(), 0u);
+}
+
+TEST(MappedFileTest, ReportsMissingFile) {
+  TempDir dir;
+  MappedFile file;
+  EXPECT_FALSE(file.map(dir.path("missing")));
+  EXPECT_EQ(errno, ENOENT);
+  EXPECT_EQ(file.data(), nullptr);
+}
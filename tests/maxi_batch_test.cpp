@@ -0,0 +1,181 @@
+#include <gtest/gtest.h>
+#include "data/dataset.h"
+#include "data/binary_corpus.h"
+#include "test_utils.h"
+
+namespace {
+const int kEos = 2;
+
+// Ids of one side of pair i
+vector<int> pair_ids(const MaxiBatch &maxi_batch, size_t i, int side) {
+  vector<int64_t> ids(maxi_batch.length(i, side));
+  maxi_batch.copy_ids(i, side, ids.data(), 1);
+  return vector<int>(ids.begin(), ids.end());
+}
+
+// Sentence of the given length ending in eos
+vector<int> sentence(size_t length, int first_id=10) {
+  vector<int> ids;
+  for(size_t t = 0; t + 1 < length; ++t) {
+    ids.push_back(first_id + t);
+  }
+  ids.push_back(kEos);
+  return ids;
+}
+
+// Pops all pairs, returning their indices in order
+vector<size_t> pop_all(MaxiBatch &maxi_batch) {
+  vector<size_t> pairs;
+  while(!maxi_batch.empty()) {
+    pairs.push_back(maxi_batch.pop());
+  }
+  return pairs;
+}
+} // namespace
+
+TEST(MaxiBatchTest, StoresPairsInOrder) {
+  vector<vector<int>> src = {sentence(3), sentence(1), sentence(5, 100)};
+  vector<vector<int>> trg = {sentence(2), sentence(4, 7), sentence(6)};
+  VectorCorpus corpus(src, trg);
+  MaxiBatch maxi_batch(1, MaxiBatchSortKey::none);
+  maxi_batch.fill(corpus, 1, 10);
+  ASSERT_EQ(maxi_batch.size(), 3u);
+  EXPECT_EQ(pop_all(maxi_batch), vector<size_t>({0, 1, 2}));
+  for(size_t i = 0; i < src.size(); ++i) {
+    EXPECT_EQ(maxi_batch.length(i, 0), src[i].size());
+    EXPECT_EQ(pair_ids(maxi_batch, i, 0), src[i]);
+    EXPECT_EQ(pair_ids(maxi_batch, i, 1), trg[i]);
+  }
+}
+
+TEST(MaxiBatchTest, CopiesIdsWithStride) {
+  VectorCorpus corpus({sentence(3)}, {sentence(2)});
+  MaxiBatch maxi_batch(1, MaxiBatchSortKey::none);
+  maxi_batch.fill(corpus, 1, 1);
+  vector<int64_t> out(6, -1);
+  maxi_batch.copy_ids(0, 0, out.data(), 2);
+  EXPECT_EQ(out, vector<int64_t>({10, -1, 11, -1, kEos, -1}));
+}
+
+TEST(MaxiBatchTest, SwitchesToWideIds) {
+  vector<vector<int>> src = {sentence(3), {70000, 65536, kEos}, sentence(2)};
+  vector<vector<int>> trg = {sentence(2), sentence(2), {100000, kEos}};
+  VectorCorpus corpus(src, trg);
+  MaxiBatch maxi_batch(1, MaxiBatchSortKey::none);
+  maxi_batch.fill(corpus, 1, 10);
+  for(size_t i = 0; i < src.size(); ++i) {
+    EXPECT_EQ(pair_ids(maxi_batch, i, 0), src[i]);
+    EXPECT_EQ(pair_ids(maxi_batch, i, 1), trg[i]);
+  }
+}
+
+TEST(MaxiBatchTest, CropKeepsEos) {
+  LengthFilter filter;
+  filter.max_length = 4;
+  filter.mode = MaxLengthMode::crop;
+  VectorCorpus corpus({sentence(10), sentence(4), {70000, 70001, 70002, 70003, 70004, kEos}},
+                      {sentence(3), sentence(6, 50), sentence(4)});
+  MaxiBatch maxi_batch(1, MaxiBatchSortKey::none, filter);
+  maxi_batch.fill(corpus, 1, 10);
+  ASSERT_EQ(maxi_batch.size(), 3u);
+  EXPECT_EQ(pair_ids(maxi_batch, 0, 0), vector<int>({10, 11, 12, kEos}));
+  EXPECT_EQ(pair_ids(maxi_batch, 0, 1), sentence(3));
+  EXPECT_EQ(pair_ids(maxi_batch, 1, 0), sentence(4));
+  EXPECT_EQ(pair_ids(maxi_batch, 1, 1), vector<int>({50, 51, 52, kEos}));
+  EXPECT_EQ(pair_ids(maxi_batch, 2, 0), vector<int>({70000, 70001, 70002, kEos}));
+  EXPECT_EQ(maxi_batch.cropped(), 3u);
+  EXPECT_EQ(maxi_batch.dropped(), 0u);
+}
+
+TEST(MaxiBatchTest, SkipDropsLongPairs) {
+  LengthFilter filter;
+  filter.max_length = 4;
+  filter.mode = MaxLengthMode::skip;
+  VectorCorpus corpus({sentence(10), sentence(4), sentence(2)}, {sentence(3), sentence(4), sentence(5)});
+  MaxiBatch maxi_batch(1, MaxiBatchSortKey::none, filter);
+  // Reads on to make up for the skipped pairs
+  maxi_batch.fill(corpus, 1, 1);
+  ASSERT_EQ(maxi_batch.size(), 1u);
+  EXPECT_EQ(pair_ids(maxi_batch, 0, 0), sentence(4));
+  EXPECT_EQ(maxi_batch.dropped(), 1u);
+  maxi_batch.fill(corpus, 1, 10);
+  ASSERT_EQ(maxi_batch.size(), 0u);
+  EXPECT_EQ(maxi_batch.dropped(), 1u);
+}
+
+TEST(MaxiBatchTest, RatioFilterUsesUncroppedLengths) {
+  LengthFilter filter;
+  filter.max_length = 4;
+  filter.max_ratio = 2;
+  VectorCorpus corpus({sentence(10), sentence(3), sentence(3)}, {sentence(4), sentence(6), sentence(1)});
+  MaxiBatch maxi_batch(1, MaxiBatchSortKey::none, filter);
+  maxi_batch.fill(corpus, 1, 10);
+  // 10/4 is over the ratio although 4/4 would not be after cropping, and so is 3/1
+  ASSERT_EQ(maxi_batch.size(), 1u);
+  EXPECT_EQ(pair_ids(maxi_batch, 0, 0), sentence(3));
+  EXPECT_EQ(maxi_batch.length(0, 1), 4u);
+  EXPECT_EQ(maxi_batch.dropped(), 2u);
+  EXPECT_EQ(maxi_batch.cropped(), 1u);
+}
+
+TEST(MaxiBatchTest, ByteBudgetCountsReadBuffers) {
+  vector<vector<int>> src(2000, sentence(20)), trg(2000, sentence(20, 50));
+  VectorCorpus corpus(src, trg);
+  const size_t max_bytes = 64 << 10;
+  MaxiBatch maxi_batch(1, MaxiBatchSortKey::none, {}, max_bytes);
+  maxi_batch.fill(corpus, 16);
+  size_t first_size = maxi_batch.size();
+  EXPECT_GT(first_size, 0u);
+  EXPECT_LT(first_size, src.size());
+  EXPECT_GE(maxi_batch.memory_bytes(), max_bytes);
+  // The buffers kept from the first fill leave less room for pairs
+  maxi_batch.fill(corpus, 16);
+  EXPECT_GT(maxi_batch.size(), 0u);
+  EXPECT_LT(maxi_batch.size(), first_size);
+
+  // Pairs are still read when the buffers alone are over the budget
+  MaxiBatch tiny(1, MaxiBatchSortKey::none, {}, 1);
+  tiny.fill(corpus, 16);
+  tiny.fill(corpus, 16);
+  EXPECT_EQ(tiny.size(), 16u);
+}
+
+TEST(MaxiBatchTest, SortsBySourceLength) {
+  VectorCorpus corpus({sentence(5), sentence(2), sentence(4), sentence(2)},
+                      {sentence(1), sentence(2), sentence(3), sentence(4)});
+  MaxiBatch maxi_batch(1, MaxiBatchSortKey::source);
+  maxi_batch.fill(corpus, 1, 10);
+  // Stable, so pairs of equal length keep their order
+  EXPECT_EQ(pop_all(maxi_batch), vector<size_t>({1, 3, 2, 0}));
+}
+
+TEST(MaxiBatchTest, FillsFromBinaryCorpusViews) {
+  TempDir dir;
+  vector<string> src_lines = numbered_lines(200, "source"), trg_lines = numbered_lines(200, "target");
+  write_file(dir.path("train.src"), join_lines(src_lines));
+  write_file(dir.path("train.trg"), join_lines(trg_lines));
+  auto src_encoder = make_test_encoder(dir.path("train.src"), dir.path("src"));
+  auto trg_encoder = make_test_encoder(dir.path("train.trg"), dir.path("trg"));
+  write_binary_corpus(dir.path("train.src"), dir.path("train.trg"), *src_encoder, *trg_encoder, false,
+                      dir.path("train.bin"));
+
+  vector<vector<int>> src_ids, trg_ids;
+  BinaryCorpus copied(dir.path("train.bin"));
+  read_all(copied, src_ids, trg_ids);
+  // Cropped sentences too go through the views
+  LengthFilter filter;
+  filter.max_length = 5;
+  VectorCorpus expected_corpus(src_ids, trg_ids);
+  BinaryCorpus corpus(dir.path("train.bin"));
+  ASSERT_TRUE(corpus.has_views());
+  MaxiBatch expected(1, MaxiBatchSortKey::none, filter), maxi_batch(1, MaxiBatchSortKey::none, filter);
+  expected.fill(expected_corpus, 1, 1000);
+  maxi_batch.fill(corpus, 1, 1000);
+  ASSERT_EQ(maxi_batch.size(), 200u);
+  ASSERT_EQ(maxi_batch.size(), expected.size());
+  EXPECT_EQ(maxi_batch.cropped(), expected.cropped());
+  for(size_t i = 0; i < maxi_batch.size(); ++i) {
+    EXPECT_EQ(pair_ids(maxi_batch, i, 0), pair_ids(expected, i, 0));
+    EXPECT_EQ(pair_ids(maxi_batch, i, 1), pair_ids(expected, i, 1));
+  }
+}
@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include "data/mixture_corpus.h"
+#include "test_utils.h"
+
+namespace {
+// Corpus of num_pairs pairs whose source ids are all first_id
+std::unique_ptr<Corpus> constant_corpus(size_t num_pairs, int first_id) {
+  return std::make_unique<VectorCorpus>(vector<vector<int>>(num_pairs, {first_id, 2}),
+                                        vector<vector<int>>(num_pairs, {first_id + 1, 2}));
+}
+
+vector<std::unique_ptr<Corpus>> two_corpora() {
+  vector<std::unique_ptr<Corpus>> corpora;
+  corpora.push_back(constant_corpus(50, 10));
+  corpora.push_back(constant_corpus(20, 20));
+  return corpora;
+}
+} // namespace
+
+TEST(MixtureCorpusTest, RejectsWeightsWithoutPositiveOne) {
+  EXPECT_THROW(MixtureCorpus(two_corpora(), {0, 0}), std::invalid_argument);
+  EXPECT_THROW(MixtureCorpus(two_corpora(), {1}), std::invalid_argument);
+}
+
+TEST(MixtureCorpusTest, NeverDrawsZeroWeightCorpus) {
+  MixtureCorpus corpus(two_corpora(), {1, 0});
+  vector<vector<int>> src_ids, trg_ids;
+  read_all(corpus, src_ids, trg_ids);
+  EXPECT_EQ(src_ids.size(), 50u);
+  for(const auto &ids : src_ids) {
+    EXPECT_EQ(ids[0], 10);
+  }
+}
+
+TEST(MixtureCorpusTest, EpochEndsOnceEveryCorpusWasRead) {
+  MixtureCorpus corpus(two_corpora(), {});
+  vector<vector<int>> src_ids, trg_ids;
+  read_all(corpus, src_ids, trg_ids);
+  size_t first = std::count_if(src_ids.begin(), src_ids.end(), [](const vector<int> &ids) { return ids[0] == 10; });
+  EXPECT_GE(first, 50u);
+  EXPECT_GE(src_ids.size() - first, 20u);
+  for(size_t i = 0; i < src_ids.size(); ++i) {
+    EXPECT_EQ(trg_ids[i][0], src_ids[i][0] + 1);
+  }
+}
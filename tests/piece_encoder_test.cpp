@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+#include "data/piece_encoder.h"
+#include "test_utils.h"
+
+namespace {
+// Encodes every line with the encoder and checks it against encoding the whole
+// line with the underlying SentencePieceProcessor
+void expect_whole_line_ids(const PieceEncoder &encoder, const vector<string> &lines) {
+  vector<int> ids, expected;
+  for(const auto &line : lines) {
+    encoder.encode(line, ids);
+    encoder.processor().Encode(line, &expected);
+    EXPECT_EQ(ids, expected) << line;
+  }
+}
+} // namespace
+
+TEST(PieceEncoderTest, CachedWordsMatchWholeLines) {
+  TempDir dir;
+  vector<string> lines = numbered_lines(300, "word");
+  lines.push_back("a\ttab");
+  lines.push_back("");
+  write_file(dir.path("train.txt"), join_lines(lines));
+  auto encoder = make_test_encoder(dir.path("train.txt"), dir.path("spm"));
+  // The second pass is served from the cache
+  expect_whole_line_ids(*encoder, lines);
+  expect_whole_line_ids(*encoder, lines);
+  EXPECT_TRUE(encoder->caching());
+  PieceCacheStats stats = encoder->take_stats();
+  EXPECT_GT(stats.hits, 0u);
+  EXPECT_LE(stats.hits, stats.lookups);
+  EXPECT_EQ(encoder->take_stats().lookups, 0u);
+}
+
+TEST(PieceEncoderTest, ReversedLinesAreEncodedWhole) {
+  TempDir dir;
+  vector<string> lines = numbered_lines(50, "word");
+  write_file(dir.path("train.txt"), join_lines(lines));
+  auto encoder = make_test_encoder(dir.path("train.txt"), dir.path("spm"), "reverse:eos");
+  expect_whole_line_ids(*encoder, lines);
+  EXPECT_EQ(encoder->take_stats().lookups, 0u);
+}
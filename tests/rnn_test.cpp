@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "models/rnn.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+const int64_t kInputDim = 3;
+const int64_t kRnnDim = 4;
+
+// {seq_len, batch_size, kInputDim}, zero past each length like embedded padding
+Tensor padded_input(const vector<int64_t> &lengths) {
+  int64_t seq_len = *std::max_element(lengths.begin(), lengths.end());
+  Tensor mask = torch::arange(seq_len).unsqueeze(1) < torch::tensor(lengths).unsqueeze(0);
+  return torch::randn({seq_len, static_cast<int64_t>(lengths.size()), kInputDim}) * mask.unsqueeze(-1);
+}
+
+// GRUCells with the parameters of each cell of a DTGRUCell. Higher cells get a
+// random weight_ih, which a zero input never reaches
+vector<GRUCell> gru_cells(DTGRUCell &cell, size_t transition_depth) {
+  torch::NoGradGuard no_grad;
+  auto params = cell->named_parameters();
+  vector<GRUCell> cells;
+  for(size_t l = 1; l <= transition_depth; ++l) {
+    string prefix = "cell" + std::to_string(l) + ".";
+    GRUCell gru(l == 1 ? kInputDim : kRnnDim, kRnnDim);
+    if(l == 1) {
+      gru->weight_ih.copy_(params[prefix + "weight_ih"]);
+    }
+    gru->weight_hh.copy_(params[prefix + "weight_hh"]);
+    gru->bias_ih.copy_(params[prefix + "bias_ih"]);
+    gru->bias_hh.copy_(params[prefix + "bias_hh"]);
+    cells.push_back(gru);
+  }
+  return cells;
+}
+
+// One GRUCell call per cell and time step, with a zero input for the higher
+// cells, as DTGRUCell used to transduce sequences
+Tensor per_step_forward(vector<GRUCell> &cells, const Tensor &input) {
+  Tensor state = torch::zeros({input.size(1), kRnnDim});
+  vector<Tensor> states;
+  for(int64_t t = 0; t < input.size(0); ++t) {
+    state = cells[0]->forward(input[t], state);
+    for(size_t l = 1; l < cells.size(); ++l) {
+      state = cells[l]->forward(torch::zeros_like(state), state);
+    }
+    states.push_back(state);
+  }
+  return torch::stack(states);
+}
+
+void expect_close(const Tensor &actual, const Tensor &expected) {
+  ASSERT_EQ(actual.sizes(), expected.sizes());
+  EXPECT_TRUE(torch::allclose(actual, expected, 1e-5, 1e-6))
+      << "largest difference " << (actual - expected).abs().max().item<float>();
+}
+} // namespace
+
+TEST(DTGRUCellTest, ProjectedInputsMatchPerStepCells) {
+  torch::manual_seed(1);
+  for(size_t depth : {2, 3}) {
+    DTGRUCell cell(kInputDim, kRnnDim, depth);
+    auto cells = gru_cells(cell, depth);
+    Tensor input = padded_input({5, 2, 4});
+    torch::NoGradGuard no_grad;
+    expect_close(cell->forward(input), per_step_forward(cells, input));
+  }
+}
+
+TEST(TransitionGRUCellTest, MatchesGRUCellWithZeroInput) {
+  torch::manual_seed(2);
+  TransitionGRUCell cell(kRnnDim);
+  GRUCell gru(kRnnDim, kRnnDim);
+  torch::NoGradGuard no_grad;
+  gru->weight_hh.copy_(cell->weight_hh);
+  gru->bias_ih.copy_(cell->bias_ih);
+  gru->bias_hh.copy_(cell->bias_hh);
+  Tensor state = torch::randn({3, kRnnDim});
+  expect_close(cell->forward(state), gru->forward(torch::zeros_like(state), state));
+}
+
+TEST(DTGRUCellTest, StepMatchesPerStepCells) {
+  torch::manual_seed(3);
+  DTGRUCell cell(kInputDim, kRnnDim, 3);
+  auto cells = gru_cells(cell, 3);
+  Tensor input = padded_input({4, 1, 3});
+  torch::NoGradGuard no_grad;
+  Tensor state = torch::zeros({input.size(1), kRnnDim});
+  vector<Tensor> states;
+  for(int64_t t = 0; t < input.size(0); ++t) {
+    state = cell->step(input[t], state);
+    states.push_back(state);
+  }
+  expect_close(torch::stack(states), per_step_forward(cells, input));
+}
+
+TEST(DTGRUCellTest, FusedGRUMatchesPerStepCell) {
+  torch::manual_seed(4);
+  DTGRUCell cell(kInputDim, kRnnDim, 1);
+  auto cells = gru_cells(cell, 1);
+  Tensor input = padded_input({5, 3, 1});
+  torch::NoGradGuard no_grad;
+  // torch::gru is told whether it is training, which must not change the result
+  for(bool training : {true, false}) {
+    cell->train(training);
+    expect_close(cell->forward(input), per_step_forward(cells, input));
+  }
+}
@@ -0,0 +1,87 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include "data/spsc_ring.h"
+
+TEST(SpscRingTest, KeepsOrderAcrossThreads) {
+  for(size_t capacity : {1, 3, 64}) {
+    SpscRing<std::unique_ptr<int>> ring(capacity);
+    const int num_items = 100000;
+    std::thread producer([&]() {
+      for(int i = 0; i < num_items; ++i) {
+        ASSERT_TRUE(ring.push(std::make_unique<int>(i)));
+      }
+      ring.close();
+    });
+    int expected = 0;
+    while(auto item = ring.pop()) {
+      ASSERT_EQ(**item, expected);
+      ++expected;
+    }
+    producer.join();
+    EXPECT_EQ(expected, num_items);
+  }
+}
+
+TEST(SpscRingTest, TryPushAndTryPopDontWait) {
+  SpscRing<int> ring(2);
+  int item = 1;
+  EXPECT_TRUE(ring.try_push(item));
+  item = 2;
+  EXPECT_TRUE(ring.try_push(item));
+  item = 3;
+  EXPECT_FALSE(ring.try_push(item));
+  EXPECT_EQ(ring.size(), 2u);
+  EXPECT_EQ(ring.try_pop(), 1);
+  EXPECT_EQ(ring.try_pop(), 2);
+  EXPECT_FALSE(ring.try_pop());
+}
+
+TEST(SpscRingTest, CloseDrainsThenEnds) {
+  SpscRing<int> ring(4);
+  ring.push(1);
+  ring.push(2);
+  ring.close();
+  EXPECT_FALSE(ring.push(3));
+  EXPECT_EQ(ring.pop(), 1);
+  EXPECT_EQ(ring.pop(), 2);
+  EXPECT_FALSE(ring.pop());
+  ring.reopen();
+  EXPECT_TRUE(ring.push(4));
+  EXPECT_EQ(ring.pop(), 4);
+}
+
+TEST(SpscRingTest, CloseWakesBlockedThreads) {
+  SpscRing<int> ring(1);
+  std::thread consumer([&]() { EXPECT_FALSE(ring.pop()); });
+  // Long enough for the consumer to stop spinning and block
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ring.close();
+  consumer.join();
+
+  ring.reopen();
+  ASSERT_TRUE(ring.push(1));
+  std::thread producer([&]() { EXPECT_FALSE(ring.push(2)); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ring.close();
+  producer.join();
+}
+
+TEST(SpscRingTest, CountsWaits) {
+  SpscRing<int> ring(1);
+  std::thread consumer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    while(ring.pop()) {}
+  });
+  ring.push(1);
+  // Waits for the consumer to make room
+  ring.push(2);
+  ring.close();
+  consumer.join();
+  RingStats stats = ring.take_stats();
+  EXPECT_EQ(stats.capacity, 1u);
+  EXPECT_EQ(stats.pops, 3u);
+  EXPECT_GE(stats.full_waits, 1u);
+  EXPECT_EQ(ring.take_stats().pops, 0u);
+}
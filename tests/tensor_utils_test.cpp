@@ -0,0 +1,22 @@
+#include <gtest/gtest.h>
+#include "tensor_utils.h"
+
+TEST(TensorUtilsTest, ReversesNonPaddingPart) {
+  Tensor lengths = torch::tensor({3, 1, 2});
+  Tensor index = reverse_padded_index(lengths, 3);
+  Tensor expected = torch::tensor({2, 0, 1,
+                                   1, 1, 0,
+                                   0, 2, 2}, torch::kLong).view({3, 3});
+  EXPECT_TRUE(torch::equal(index, expected));
+}
+
+TEST(TensorUtilsTest, GatherRestoresSequences) {
+  Tensor lengths = torch::tensor({4, 2, 3});
+  Tensor ids = torch::arange(15).view({5, 3});
+  Tensor index = reverse_padded_index(lengths, 5);
+  // Reversing twice gives the sequences back
+  EXPECT_TRUE(torch::equal(ids.gather(0, index).gather(0, index), ids));
+  // Padding steps stay in place
+  EXPECT_TRUE(torch::equal(ids.gather(0, index).slice(0, 4), ids.slice(0, 4)));
+  EXPECT_EQ(ids.gather(0, index)[0][1].item<int64_t>(), ids[1][1].item<int64_t>());
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <sentencepiece_processor.h>
+#include <sentencepiece_trainer.h>
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "data/corpus.h"
+#include "data/piece_encoder.h"
+
+using std::string;
+using std::vector;
+
+// Directory for the files of one test, removed with it
+class TempDir {
+ public:
+  TempDir() {
+    const auto *test = ::testing::UnitTest::GetInstance()->current_test_info();
+    path_ = std::filesystem::temp_directory_path()
+            / (string("mtness_") + test->test_suite_name() + "_" + test->name());
+    std::filesystem::remove_all(path_);
+    std::filesystem::create_directories(path_);
+  }
+  ~TempDir() { std::filesystem::remove_all(path_); }
+  TempDir(const TempDir&) = delete;
+  TempDir& operator=(const TempDir&) = delete;
+
+  string path(const string &name) const { return (path_ / name).string(); }
+
+ private:
+  std::filesystem::path path_;
+};
+
+inline void write_file(const string &path, const string &content) {
+  std::ofstream file(path, std::ios::binary);
+  file << content;
+}
+
+// Text of lines, each followed by a newline
+inline string join_lines(const vector<string> &lines) {
+  string text;
+  for(const auto &line : lines) {
+    text += line + "\n";
+  }
+  return text;
+}
+
+// Numbered sentences with words repeated across lines, so that the word cache
+// of a PieceEncoder is exercised
+inline vector<string> numbered_lines(size_t num_lines, const string &prefix) {
+  vector<string> lines;
+  for(size_t i = 0; i < num_lines; ++i) {
+    lines.push_back(prefix + " sentence number " + std::to_string(i) + " of the test corpus");
+  }
+  return lines;
+}
+
+// Trains a small SPM model on text_path and loads it as load_vocab does
+inline std::shared_ptr<PieceEncoder> make_test_encoder(const string &text_path,
+                                                       const string &model_prefix,
+                                                       const string &extra_options="eos") {
+  auto status = sentencepiece::SentencePieceTrainer::Train(
+      "--input=" + text_path + " --model_prefix=" + model_prefix
+      + " --vocab_size=64 --hard_vocab_limit=false --minloglevel=2");
+  EXPECT_TRUE(status.ok()) << status.ToString();
+  auto spm_processor = std::make_unique<sentencepiece::SentencePieceProcessor>();
+  status = spm_processor->Load(model_prefix + ".model");
+  EXPECT_TRUE(status.ok()) << status.ToString();
+  auto encoder = std::make_shared<PieceEncoder>(std::move(spm_processor), 1000);
+  encoder->set_extra_options(extra_options);
+  return encoder;
+}
+
+// Encoded pairs held in memory, to feed corpus wrappers and MaxiBatch
+class VectorCorpus : public Corpus {
+ public:
+  VectorCorpus(vector<vector<int>> src_ids, vector<vector<int>> trg_ids)
+      : src_ids_(std::move(src_ids)), trg_ids_(std::move(trg_ids)) {}
+
+  bool next(vector<int> &src_ids, vector<int> &trg_ids) override {
+    if(position_ >= src_ids_.size()) {
+      return false;
+    }
+    src_ids = src_ids_[position_];
+    trg_ids = trg_ids_[position_];
+    ++position_;
+    ++pairs_read_;
+    return true;
+  }
+  void reset() override { position_ = 0; }
+  std::optional<size_t> size() const override { return src_ids_.size(); }
+  vector<int64_t> state() const override { return {static_cast<int64_t>(position_)}; }
+  void restore(const vector<int64_t> &state) override { position_ = state.at(0); }
+
+  // Pairs handed out by next() so far, over all epochs
+  size_t pairs_read() const { return pairs_read_; }
+
+ private:
+  vector<vector<int>> src_ids_, trg_ids_;
+  size_t position_ = 0;
+  size_t pairs_read_ = 0;
+};
+
+// Reads a corpus to its end one pair at a time
+inline void read_all(Corpus &corpus, vector<vector<int>> &src_ids, vector<vector<int>> &trg_ids) {
+  src_ids.clear();
+  trg_ids.clear();
+  vector<int> src, trg;
+  while(corpus.next(src, trg)) {
+    src_ids.push_back(src);
+    trg_ids.push_back(trg);
+  }
+}